@@ -1,97 +1,798 @@
 #include <iostream>
 #include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
+#include <sstream>
+#include <memory>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <boost/program_options.hpp>
 #include <boost/filesystem.hpp>
 #include "opts_helper.h"
 #include "krb5_wrapper.h"
+#include "formatter.h"
+#include "keytab_watch.h"
+#include "keytab_cache.h"
+#include "keytab_diff.h"
+#include "entry_filter.h"
+#include "keytab_check.h"
+#include "directory_walker.h"
+#include "keytab_loader.h"
+#include "statistics.h"
+#include "audit_log.h"
 
 using namespace std;
 using namespace arsoft::krb5;
 
 #define SYSTEM_KEYTAB "/etc/krb5.keytab"
 
+// an operation which is recorded in the cache once all operations succeeded
+struct completed_operation {
+    string operation;
+    keytab_state_cache::state state;
+    string result;
+};
+
 struct console_list_handler {
-    enum OutputLevel {
-        OutputLevelPrincipal = 0x01,
-        OutputLevelKeyVersion = 0x02,
-        OutputLevelEncryptionType = 0x04,
-        OutputLevelTimestamp = 0x08,
-        OutputLevelMagic = 0x10,
-        OutputLevelDefault = OutputLevelPrincipal|OutputLevelKeyVersion|OutputLevelEncryptionType|OutputLevelTimestamp
-    };
-    OutputLevel _level;
-    console_list_handler(OutputLevel level=OutputLevelDefault)
-        : _level(level) {}
+    const entry_formatter & _formatter;
+    output_buffer & _out;
+    const std::string & _keytab_name;
+    console_list_handler(const entry_formatter & formatter, output_buffer & out, const std::string & keytab_name)
+        : _formatter(formatter), _out(out), _keytab_name(keytab_name) {}
 
     void operator()(const keytab_entry & e)
     {
-        bool first = true;
-        if(_level & OutputLevelMagic)
+        const principal p = e.get_principal();
+        const std::string & name = p.name();
+        statistics::timer t(statistics::phase_output);
+        _formatter(_out, e, name, _keytab_name);
+    }
+
+    void operator()(const keytab_entry & e, const std::string & principal_name)
+    {
+        statistics::timer t(statistics::phase_output);
+        _formatter(_out, e, principal_name, _keytab_name);
+    }
+};
+
+struct sorted_list_handler {
+    typedef std::vector<keytab_entry> keytab_entry_list;
+    arena _arena;
+    keytab_entry_list _list;
+    std::vector<unsigned> _principals;
+    principal_table _table;
+    sorted_list_handler(const context & ctx)
+        : _table(ctx)
+    {
+    }
+
+    void operator()(const keytab_entry & e)
+    {
+        _principals.push_back(_table.intern(e.get_principal()));
+        _list.push_back(keytab_entry(e, _arena));
+    }
+
+    template<typename LIST_HANDLER>
+    void list(LIST_HANDLER & handler)
+    {
+        std::vector<entry_sort_key> sorted(_list.size());
         {
-            if(!first) cout << ", ";
-            first = false;
-            cout << std::hex << e.get_magic() << std::dec;
+            statistics::timer t(statistics::phase_sort);
+            for(unsigned i = 0; i < sorted.size(); ++i)
+            {
+                const keytab_entry & entry = _list[i];
+                entry_sort_key & key = sorted[i];
+                key.principal_rank = _table.rank(_principals[i]);
+                key.key_version = entry.get_key_version();
+                key.encryption = entry.get_encryption();
+                key.index = i;
+            }
+            std::sort(sorted.begin(), sorted.end());
         }
-        if(_level & OutputLevelPrincipal)
+        for(std::vector<entry_sort_key>::const_iterator it = sorted.begin(); it != sorted.end(); ++it)
         {
-            if(!first) cout << ", ";
-            first = false;
-            cout << e.get_principal().name();
+            const keytab_entry & entry = _list[it->index];
+            handler(entry, _table.name(_principals[it->index]));
         }
-        if(_level & OutputLevelKeyVersion)
+    }
+
+};
+
+
+
+// With a cache, the listing of an unchanged keytab is replayed from the cache
+// and a new listing is returned in completed, to be stored in the cache once
+// all operations succeeded. The state of the keytab must be captured into
+// completed before contents have been read; otherwise it is captured here.
+void list_keytab(const context & ctx, const string & filename, const entry_formatter & formatter, output_buffer & out,
+                 const entry_filter * filter=NULL, const keytab_state_cache * cache=NULL, const string * contents=NULL,
+                 completed_operation * completed=NULL)
+{
+    if(cache && completed)
+    {
+        std::ostringstream os;
+        os << "list " << formatter.format() << ' ' << formatter.fields();
+        if(filter)
+            os << ' ' << filter->description();
+        const vector<string> keytabs(1, filename);
+        std::string output;
+        if(cache->lookup(os.str(), keytabs, output))
+            completed->state = keytab_state_cache::state();
+        else
+        {
+            if(completed->state.empty())
+                cache->capture(completed->state, filename, false);
+            output.clear();
+            {
+                output_buffer buf(output);
+                list_keytab(ctx, filename, formatter, buf, filter, NULL, contents);
+            }
+            completed->operation = os.str();
+            completed->result = output;
+        }
+        out.write(output);
+        return;
+    }
+
+    keytab kt(ctx, filename);
+    kt.set_filter(filter);
+    kt.set_contents(contents);
+    if(formatter.format() == output_format_text)
+    {
+        out.write("Keytab name: FILE:");
+        out.write(filename);
+        out.put('\n');
+    }
+    sorted_list_handler sorted_handler(ctx);
+    kt.list<sorted_list_handler>(sorted_handler);
+    console_list_handler handler(formatter, out, filename);
+    sorted_handler.list<console_list_handler>(handler);
+}
+
+// Lists keytabs on a pool of worker threads, each with its own Kerberos
+// context from the context_pool. The listings are collected in a reorder buffer and printed in the
+// order of the given file names. Workers do not run further ahead than the
+// size of the reorder window.
+class parallel_lister
+{
+    struct result {
+        bool done;
+        bool failed;
+        std::string output;
+        completed_operation completed;
+        result() : done(false), failed(false) {}
+    };
+    const vector<string> & _filenames;
+    const entry_formatter & _formatter;
+    const entry_filter * _filter;
+    const keytab_state_cache * _cache;
+    vector<result> _results;
+    vector<completed_operation> _completed;
+    size_t _next;
+    size_t _printed;
+    size_t _window;
+    bool _stop;
+    std::mutex _mutex;
+    std::condition_variable _cond;
+
+    void worker()
+    {
+        const context & ctx = context_pool::instance().acquire();
+        for(;;)
         {
-            if(!first) cout << ", ";
-            first = false;
-            cout << e.get_key_version();
+            size_t index;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                while(!_stop && _next < _filenames.size() && _next >= _printed + _window)
+                    _cond.wait(lock);
+                if(_stop || _next >= _filenames.size())
+                    return;
+                index = _next++;
+            }
+
+            result r;
+            try
+            {
+                output_buffer out(r.output);
+                list_keytab(ctx, _filenames[index], _formatter, out, _filter, _cache, NULL, &r.completed);
+            }
+            catch(error & e)
+            {
+                r.failed = true;
+                std::ostringstream os;
+                os << "Kerberos error " << e.code() << ": " << e.what() << endl;
+                r.output = os.str();
+            }
+            catch(std::exception & e)
+            {
+                // anything else would terminate the whole process
+                r.failed = true;
+                r.output = std::string("Error: ") + e.what() + "\n";
+            }
+            r.done = true;
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _results[index] = std::move(r);
+            }
+            _cond.notify_all();
         }
-        if(_level & OutputLevelKeyVersion)
+    }
+
+public:
+    parallel_lister(const vector<string> & filenames, const entry_formatter & formatter,
+                    const entry_filter * filter=NULL, const keytab_state_cache * cache=NULL)
+        : _filenames(filenames), _formatter(formatter), _filter(filter), _cache(cache), _results(filenames.size()), _next(0), _printed(0), _window(0), _stop(false)
+    {
+    }
+
+    // returns false if a keytab could not be listed; just like the sequential
+    // listing, no further keytabs are printed after an error.
+    bool run(unsigned jobs, output_buffer & out)
+    {
+        bool ret = true;
+        _window = jobs * 4;
+        std::vector<std::thread> threads;
+        for(unsigned i = 0; i < jobs && i < _filenames.size(); ++i)
+            threads.push_back(std::thread(&parallel_lister::worker, this));
+
+        for(size_t i = 0; ret && i < _filenames.size(); ++i)
         {
-            if(!first) cout << ", ";
-            first = false;
-            cout << e.get_encryption_as_string();
+            result r;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                while(!_results[i].done)
+                    _cond.wait(lock);
+                r = std::move(_results[i]);
+                _printed = i + 1;
+            }
+            _cond.notify_all();
+            if(r.failed)
+            {
+                out.flush();
+                cerr << r.output;
+                ret = false;
+            }
+            else
+            {
+                out.write(r.output);
+                if(!r.completed.operation.empty())
+                    _completed.push_back(std::move(r.completed));
+            }
         }
-        if(_level & OutputLevelKeyVersion)
+
         {
-            if(!first) cout << ", ";
-            first = false;
-            cout << e.get_timestamp().to_string();
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
         }
-        if(!first)
-            cout << endl;
+        _cond.notify_all();
+        for(std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it)
+            it->join();
+        return ret;
     }
+
+    // the new listings for the cache
+    const vector<completed_operation> & completed() const { return _completed; }
 };
 
-struct sorted_list_handler {
-    typedef std::list<keytab_entry> keytab_entry_list;
-    keytab_entry_list _list;
-    sorted_list_handler()
+// Updates (or copies into) several destination keytabs from one snapshot of
+// the source keytab on a pool of worker threads, each with its own Kerberos
+// context from the context_pool.
+class parallel_updater
+{
+    const keytab_snapshot & _source;
+    const vector<string> & _destinations;
+    bool _copy;
+    vector<string> _errors;
+    vector<char> _succeeded;
+    size_t _next;
+    std::mutex _mutex;
+
+    void worker()
+    {
+        const context & ctx = context_pool::instance().acquire();
+        for(;;)
+        {
+            size_t index;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if(_next >= _destinations.size())
+                    return;
+                index = _next++;
+            }
+
+            bool ok = false;
+            std::string message;
+            try
+            {
+                keytab destKeyTab(ctx, _destinations[index]);
+                ok = _copy ? destKeyTab.copy(_source) : destKeyTab.update(_source);
+                if(!ok)
+                    message = (_copy ? "Failed to copy into " : "Failed to update ") + _destinations[index];
+            }
+            catch(error & e)
+            {
+                std::ostringstream os;
+                os << "Kerberos error " << e.code() << ": " << e.what();
+                message = os.str();
+            }
+            catch(std::exception & e)
+            {
+                // anything else would terminate the whole process
+                message = std::string("Error: ") + e.what();
+            }
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            _succeeded[index] = ok;
+            _errors[index] = message;
+        }
+    }
+
+public:
+    parallel_updater(const keytab_snapshot & source, const vector<string> & destinations, bool copy)
+        : _source(source), _destinations(destinations), _copy(copy),
+          _errors(destinations.size()), _succeeded(destinations.size(), false), _next(0)
     {
     }
 
-    void operator()(const keytab_entry & e)
+    // returns false if any destination could not be updated; the errors are
+    // reported in the order of the destinations.
+    bool run(unsigned jobs)
     {
-        _list.push_back(e);
+        std::vector<std::thread> threads;
+        for(unsigned i = 1; i < jobs && i < _destinations.size(); ++i)
+            threads.push_back(std::thread(&parallel_updater::worker, this));
+        worker();
+        for(std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it)
+            it->join();
+
+        bool ret = true;
+        for(size_t i = 0; i < _destinations.size(); ++i)
+        {
+            if(!_succeeded[i])
+            {
+                cerr << _errors[i] << endl;
+                ret = false;
+            }
+        }
+        return ret;
     }
 
-    static bool sort_by_principal(const keytab_entry& first, const keytab_entry& second)
+    bool succeeded(size_t index) const { return _succeeded[index] != 0; }
+};
+
+// Reads several keytabs into snapshots on a pool of worker threads, each with
+// its own Kerberos context from the context_pool.
+class parallel_loader
+{
+    const vector<string> & _filenames;
+    const entry_filter * _filter;
+    vector< std::unique_ptr<keytab_snapshot> > _snapshots;
+    vector<string> _errors;
+    size_t _next;
+    std::mutex _mutex;
+
+    void worker()
     {
-        return first.get_principal() < second.get_principal();
+        const context & ctx = context_pool::instance().acquire();
+        for(;;)
+        {
+            size_t index;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if(_next >= _filenames.size())
+                    return;
+                index = _next++;
+            }
+
+            std::string message;
+            try
+            {
+                keytab sourceKeyTab(ctx, _filenames[index]);
+                sourceKeyTab.set_filter(_filter);
+                if(!sourceKeyTab.snapshot(*_snapshots[index]))
+                    message = "Failed to read " + _filenames[index];
+            }
+            catch(error & e)
+            {
+                std::ostringstream os;
+                os << "Kerberos error " << e.code() << ": " << e.what();
+                message = os.str();
+            }
+            catch(std::exception & e)
+            {
+                // anything else would terminate the whole process
+                message = std::string("Error: ") + e.what();
+            }
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            _errors[index] = message;
+        }
     }
 
-    template<typename LIST_HANDLER>
-    void list(LIST_HANDLER & handler)
+public:
+    parallel_loader(const vector<string> & filenames, const entry_filter * filter=NULL)
+        : _filenames(filenames), _filter(filter), _snapshots(filenames.size()), _errors(filenames.size()), _next(0)
     {
-        _list.sort(sort_by_principal);
-        for(keytab_entry_list::const_iterator it = _list.begin(); it != _list.end(); ++it)
+        for(size_t i = 0; i < _snapshots.size(); ++i)
+            _snapshots[i].reset(new keytab_snapshot);
+    }
+
+    // returns false if any keytab could not be read; the errors are reported
+    // in the order of the file names.
+    bool run(unsigned jobs)
+    {
+        std::vector<std::thread> threads;
+        for(unsigned i = 1; i < jobs && i < _filenames.size(); ++i)
+            threads.push_back(std::thread(&parallel_loader::worker, this));
+        worker();
+        for(std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it)
+            it->join();
+
+        bool ret = true;
+        for(size_t i = 0; i < _filenames.size(); ++i)
         {
-            const keytab_entry & entry = *it;
-            handler(entry);
+            if(!_errors[i].empty())
+            {
+                cerr << _errors[i] << endl;
+                ret = false;
+            }
         }
+        return ret;
     }
 
+    // the snapshots in the order of the file names
+    vector<const keytab_snapshot*> snapshots() const
+    {
+        vector<const keytab_snapshot*> ret;
+        for(size_t i = 0; i < _snapshots.size(); ++i)
+            ret.push_back(_snapshots[i].get());
+        return ret;
+    }
 };
 
+// Lists, expunges and checks every keytab found by the directory_walker; all
+// operations on a batch of keytabs are done by the worker which took it, with
+// the Kerberos context of its thread. For the listing and the check the whole
+// batch is read at once with the keytab_file_loader. The results are collected
+// per keytab and reported in the order of the paths once the whole tree has
+// been processed.
+class tree_processor : public directory_walker::file_handler
+{
+public:
+    struct result {
+        std::string listing;
+        keytab_health health;
+        std::string error;
+        bool expunged;
+        bool unchanged;         // expunge skipped, because the keytab is unchanged
+        size_t reclaimed;       // bytes reclaimed by the compaction
+        completed_operation listed;     // new listing for the cache
+        result() : expunged(false), unchanged(false), reclaimed(0) {}
+    };
+    typedef std::map<std::string, result> result_map;
+
+private:
+    const entry_formatter * _list;
+    bool _check;
+    bool _expunge;
+    bool _compact;
+    const entry_filter * _filter;
+    const keytab_state_cache * _cache;
+    const string _operation;
+    result_map _results;
+    std::mutex _mutex;
+
+public:
+    tree_processor(const entry_formatter * list, bool check, bool expunge, bool compact, const entry_filter * filter,
+                   const keytab_state_cache * cache, const string & filter_suffix)
+        : _list(list), _check(check), _expunge(expunge), _compact(compact), _filter(filter), _cache(cache),
+          _operation("expunge" + filter_suffix)
+    {
+    }
+
+private:
+    void process(const std::string & path, const std::string * contents, keytab_state_cache::state * captured=NULL)
+    {
+        const context & ctx = context_pool::instance().acquire();
+        result r;
+        if(captured && contents)
+            r.listed.state = *captured;
+        try
+        {
+            if(_list)
+            {
+                output_buffer out(r.listing);
+                list_keytab(ctx, path, *_list, out, _filter, _cache, contents, &r.listed);
+            }
+            if(_expunge)
+            {
+                const vector<string> keytabs(1, path);
+                if(_cache && _cache->lookup(_operation, keytabs))
+                    r.unchanged = true;
+                else
+                {
+                    keytab kt(ctx, path);
+                    kt.set_filter(_filter);
+                    if(!kt.expunge())
+                        r.error = "Failed to expunge";
+                    else
+                    {
+                        r.expunged = true;
+                        // a failed store only means the keytab is expunged again next time
+                        if(_cache)
+                            _cache->store(_operation, keytabs);
+                    }
+                }
+            }
+            if(_compact && r.error.empty())
+            {
+                keytab kt(ctx, path);
+                kt.compact(r.reclaimed);
+            }
+            // the check reports the state after the expunge and compaction
+            if(_check && r.error.empty())
+            {
+                keytab kt(ctx, path);
+                kt.set_filter(_filter);
+                if(!r.expunged && !r.reclaimed)
+                    kt.set_contents(contents);
+                check_keytab(kt, r.health);
+            }
+        }
+        catch(error & e)
+        {
+            std::ostringstream os;
+            os << "Kerberos error " << e.code() << ": " << e.what();
+            r.error = os.str();
+        }
+        catch(std::exception & e)
+        {
+            // anything else would terminate the whole process
+            r.error = std::string("Error: ") + e.what();
+        }
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _results[path] = std::move(r);
+    }
 
+    struct load_handler : public keytab_file_loader::completion_handler {
+        tree_processor & _processor;
+        const std::vector<std::string> & _paths;
+        std::vector<keytab_state_cache::state> & _captured;
+        load_handler(tree_processor & processor, const std::vector<std::string> & paths, std::vector<keytab_state_cache::state> & captured)
+            : _processor(processor), _paths(paths), _captured(captured) {}
+        virtual void operator()(size_t index, int error, std::string & contents)
+        {
+            // keytabs which could not be loaded are read again to report the error
+            _processor.process(_paths[index], error ? NULL : &contents, _captured.empty() ? NULL : &_captured[index]);
+        }
+    };
+
+public:
+    virtual void operator()(const std::vector<std::string> & paths)
+    {
+        if(!_list && !_check)
+        {
+            for(std::vector<std::string>::const_iterator it = paths.begin(); it != paths.end(); ++it)
+                process(*it, NULL);
+            return;
+        }
+        // the state of the listed keytabs is captured before they are read
+        std::vector<keytab_state_cache::state> captured;
+        if(_list && _cache)
+        {
+            captured.resize(paths.size());
+            for(size_t i = 0; i < paths.size(); ++i)
+                _cache->capture(captured[i], paths[i], false);
+        }
+        // the listing and the check read all keytabs of the batch at once
+        keytab_file_loader loader(paths.size());
+        load_handler handler(*this, paths, captured);
+        loader.load(paths, handler);
+    }
+
+    const result_map & results() const { return _results; }
+};
+
+// writes the listings, the health of all keytabs and a summary of a recursive
+// run; returns 2 if any keytab failed, 1 if the check found problems and 0
+// otherwise
+int report_tree(const tree_processor::result_map & results, const entry_formatter * list,
+                const health_formatter * check, bool expunge, bool compact)
+{
+    output_buffer out(STDOUT_FILENO);
+    size_t failed = 0;
+    size_t warnings = 0;
+    size_t expunged = 0;
+    size_t unchanged = 0;
+    size_t reclaimed = 0;
+    if(list)
+    {
+        list->header(out);
+        for(tree_processor::result_map::const_iterator it = results.begin(); it != results.end(); ++it)
+            out.write(it->second.listing);
+    }
+    if(check)
+        check->header(out);
+    for(tree_processor::result_map::const_iterator it = results.begin(); it != results.end(); ++it)
+    {
+        const tree_processor::result & r = it->second;
+        if(!r.error.empty())
+        {
+            ++failed;
+            continue;
+        }
+        if(r.expunged)
+            ++expunged;
+        if(r.unchanged)
+            ++unchanged;
+        reclaimed += r.reclaimed;
+        if(check)
+        {
+            switch(r.health.status())
+            {
+            case keytab_health::failed: ++failed; break;
+            case keytab_health::warning: ++warnings; break;
+            default: break;
+            }
+            (*check)(out, it->first, r.health);
+        }
+    }
+    // the summary is only added to the human readable report
+    if((!list || list->format() == output_format_text) && (!check || check->format() == output_format_text))
+    {
+        std::ostringstream os;
+        os << results.size() << " keytabs";
+        if(check)
+            os << ", " << warnings << " with warnings";
+        if(expunge)
+            os << ", " << expunged << " expunged, " << unchanged << " unchanged";
+        if(compact)
+            os << ", " << reclaimed << " bytes reclaimed";
+        os << ", " << failed << " failed" << endl;
+        out.write(os.str());
+    }
+    out.flush();
+
+    for(tree_processor::result_map::const_iterator it = results.begin(); it != results.end(); ++it)
+    {
+        if(!it->second.error.empty())
+            cerr << it->first << ": " << it->second.error << endl;
+    }
+    if(failed || out.failed())
+        return 2;
+    return warnings ? 1 : 0;
+}
+
+// keeps all destinations (filenames[1..]) in sync with the source keytab
+// (filenames[0]) until the process is terminated
+int watch_keytabs(const context & ctx, const vector<string> & filenames,
+                  bool expunge, unsigned delay, bool verbose, const entry_filter * filter)
+{
+    keytab_watch watch(ctx, expunge);
+    watch.set_filter(filter);
+    watch.set_delay(delay);
+    watch.set_verbose(verbose);
+    for(vector<string>::const_iterator it = filenames.begin() + 1; it != filenames.end(); ++it)
+    {
+        if(*it == filenames.front())
+        {
+            cerr << "Source and destination keytab file (" << *it << ") are identical." << endl;
+            return 1;
+        }
+        watch.add(filenames.front(), *it);
+    }
+    int err = watch.run();
+    if(err)
+    {
+        cerr << "Failed to watch " << filenames.front() << ": " << strerror(err) << endl;
+        return 2;
+    }
+    return 0;
+}
+
+// looks up each principal in the keytab and prints its latest entry if
+// requested; returns 0 if all principals have been found and 1 otherwise
+int find_principals(const context & ctx, const string & filename, const vector<string> & principals,
+                    const entry_formatter & formatter, output_buffer & out, bool print, const entry_filter * filter)
+{
+    keytab kt(ctx, filename);
+    kt.set_filter(filter);
+    // a scan stops at the first match and is about ten times faster than
+    // loading the keytab, so only many lookups are answered from memory
+    // (unless the sidecar index is used anyway)
+    if(principals.size() > 8 && !(filter && filter->use_index()))
+        kt.load();
+    int ret = 0;
+    console_list_handler handler(formatter, out, filename);
+    for(vector<string>::const_iterator it = principals.begin(); it != principals.end(); ++it)
+    {
+        bool found = print ? kt.find_latest(*it, keytab::any_encryption, handler) : kt.find(*it);
+        if(!found)
+        {
+            if(print)
+                cerr << "No entry of " << *it << " in " << filename << endl;
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+// builds the entry filter from the filter options; returns false and reports
+// the invalid value if an option cannot be parsed
+bool parse_filter(const context & ctx, const boost::program_options::variables_map & vm, entry_filter & filter)
+{
+    typedef vector<string> string_list;
+    if(vm.count("principal"))
+    {
+        const string_list & values = vm["principal"].as<string_list>();
+        for(string_list::const_iterator it = values.begin(); it != values.end(); ++it)
+        {
+            if(!filter.add_principal(ctx, *it))
+            {
+                cerr << "Invalid principal pattern " << *it << endl;
+                return false;
+            }
+        }
+    }
+    if(vm.count("regex"))
+    {
+        const string_list & values = vm["regex"].as<string_list>();
+        for(string_list::const_iterator it = values.begin(); it != values.end(); ++it)
+        {
+            if(!filter.add_regex(*it))
+            {
+                cerr << "Invalid regular expression " << *it << endl;
+                return false;
+            }
+        }
+    }
+    if(vm.count("realm"))
+    {
+        const string_list & values = vm["realm"].as<string_list>();
+        for(string_list::const_iterator it = values.begin(); it != values.end(); ++it)
+            filter.add_realm(*it);
+    }
+    if(vm.count("service"))
+    {
+        const string_list & values = vm["service"].as<string_list>();
+        for(string_list::const_iterator it = values.begin(); it != values.end(); ++it)
+            filter.add_service(*it);
+    }
+    if(vm.count("enctype"))
+    {
+        const string_list & values = vm["enctype"].as<string_list>();
+        for(string_list::const_iterator it = values.begin(); it != values.end(); ++it)
+        {
+            if(!filter.add_enctypes(*it))
+            {
+                cerr << "Invalid enctype " << *it << endl;
+                return false;
+            }
+        }
+    }
+    if(vm.count("kvno") && !filter.set_key_version_range(vm["kvno"].as<string>()))
+    {
+        cerr << "Invalid kvno range " << vm["kvno"].as<string>() << endl;
+        return false;
+    }
+    if(vm.count("since") && !filter.set_since(vm["since"].as<string>()))
+    {
+        cerr << "Invalid time " << vm["since"].as<string>() << endl;
+        return false;
+    }
+    if(vm.count("until") && !filter.set_until(vm["until"].as<string>()))
+    {
+        cerr << "Invalid time " << vm["until"].as<string>() << endl;
+        return false;
+    }
+    return true;
+}
 
 int main(int argc, char ** argv)
 {
@@ -107,10 +808,35 @@ int main(int argc, char ** argv)
       ("verbose,v", "enable verbose output")
       ("version,V", "show version number")
       ("list,l", po::value<vector<string> >()->multitoken()->zero_tokens()->composing(), "list all entries of the given keytab")
-      ("update,u", po::value< vector<string> >()->multitoken()->zero_tokens()->composing(), "copies new or missing entries from source keytab to destination")
-      ("copy,c", po::value< vector<string> >()->multitoken()->zero_tokens()->composing(), "copies all entries from source keytab to destination")
+      ("jobs,j", po::value<unsigned>()->default_value(1), "number of keytabs to list or update in parallel")
+      ("format,f", po::value<string>()->default_value("text"), "output format of the list and diff: text, tsv, csv or jsonl")
+      ("fields", po::value<string>(), "comma separated list of fields to list: keytab, magic, principal, kvno, enctype, timestamp")
+      ("update,u", po::value< vector<string> >()->multitoken()->zero_tokens()->composing(), "copies new or missing entries from source keytab to one or more destinations")
+      ("copy,c", po::value< vector<string> >()->multitoken()->zero_tokens()->composing(), "copies all entries from source keytab to one or more destinations")
+      ("merge,m", po::value< vector<string> >()->multitoken()->zero_tokens()->composing(), "merges the new or missing entries of all source keytabs into the first (destination) keytab")
+      ("diff,d", po::value< vector<string> >()->multitoken()->zero_tokens()->composing(), "shows the entries which have been added, removed, rekeyed or got a new timestamp in the second keytab; exits with 1 if the keytabs differ")
       ("expunge,E", po::value< vector<string> >()->multitoken()->zero_tokens()->composing(), "remove all duplicated or obsolete keytab entries.")
-      ("remove,r", po::value< vector<string> >()->multitoken()->zero_tokens()->composing(), "remove all entries with matching principals from the keytab")
+      ("check", po::value< vector<string> >()->multitoken()->zero_tokens()->composing(), "checks the keytabs for obsolete, duplicated and weak entries and unsafe permissions; exits with 1 if any problem has been found")
+      ("get", po::value< vector<string> >()->multitoken()->composing(), "print the entry with the highest kvno of each given principal in the keytab (first argument); exits with 1 if a principal has no entry")
+      ("exists", po::value< vector<string> >()->multitoken()->composing(), "exit with 0 if the keytab (first argument) contains all given principals and with 1 otherwise, without any output")
+      ("compact", po::value< vector<string> >()->multitoken()->zero_tokens()->composing(), "rewrite the given keytabs, and all keytabs modified by other actions, without the space left behind by removed entries")
+      ("recursive,R", po::value< vector<string> >()->composing(), "process all keytabs below the given directory with --list, --check, --expunge and --compact")
+      ("pattern", po::value<string>()->default_value("*.keytab"), "file name pattern of the keytabs processed with --recursive")
+      ("remove,r", po::value< vector<string> >()->multitoken()->zero_tokens()->composing(), "remove all entries with matching principals (or glob patterns) from the keytab; without principals all entries matching the filter options are removed")
+      ("principal,p", po::value< vector<string> >()->composing(), "only process entries of principals matching the glob pattern")
+      ("regex", po::value< vector<string> >()->composing(), "only process entries of principals matching the regular expression (in addition to any --principal pattern)")
+      ("realm", po::value< vector<string> >()->composing(), "only process entries of the given realm")
+      ("service", po::value< vector<string> >()->composing(), "only process entries with the given service (first principal component)")
+      ("enctype", po::value< vector<string> >()->composing(), "only process entries with one of the given (comma separated) enctypes")
+      ("kvno", po::value<string>(), "only process entries within the kvno range N, N-M, N- or -M")
+      ("since", po::value<string>(), "only process entries with a timestamp at or after the given time (seconds or YYYY-MM-DD[THH:MM:SS] in UTC)")
+      ("until", po::value<string>(), "only process entries with a timestamp at or before the given time")
+      ("index", "look up the entries of the --principal patterns in a sidecar index (<keytab>.idx), which is built on first use")
+      ("stats", po::value<string>()->implicit_value("text"), "print counters and the time spent in each phase to stderr when done, as text or json")
+      ("audit-log", po::value<string>(), "append every added and removed entry (without its key) to the given file as JSON lines")
+      ("cache-dir", po::value<string>(), "directory with the state of previous runs; unchanged keytabs are skipped")
+      ("watch,w", "keep watching the source keytab of --update and update all destinations on changes")
+      ("watch-delay", po::value<unsigned>()->default_value(200), "milliseconds without further changes before the destinations are updated")
       ;
 
     po::positional_options_description positionalOptions;
@@ -153,100 +879,416 @@ int main(int argc, char ** argv)
       return 1;
     }
 
+    const uint64_t started = statistics::now();
+    string stats_format;
+    if(vm.count("stats"))
+    {
+        stats_format = vm["stats"].as<string>();
+        if(stats_format != "text" && stats_format != "json")
+        {
+            cerr << "Invalid statistics format " << stats_format << endl;
+            return 1;
+        }
+        statistics::enable_timers(true);
+    }
+
+    std::unique_ptr<audit_log> audit;
+    if(vm.count("audit-log"))
+    {
+        audit.reset(new audit_log(vm["audit-log"].as<string>()));
+        int err = audit->open();
+        if(err)
+        {
+            cerr << "Failed to open the audit log " << vm["audit-log"].as<string>() << ": " << strerror(err) << endl;
+            return 2;
+        }
+        audit_log::install(audit.get());
+    }
+
     try {
         bool expunge = vm.count("expunge") != 0;
+        bool compact = vm.count("compact") != 0;
+        bool watch = vm.count("watch") != 0;
+        bool verbose = vm.count("verbose") != 0;
         vector<string> expunge_filenames;
-        cout << "expunge: " << expunge << endl;
+        // keytabs which are compacted once all other actions succeeded
+        vector<string> compact_filenames;
+        if(compact)
+            compact_filenames = vm["compact"].as< vector<string> >();
+        // operations which are recorded in the cache once all of them succeeded
+        vector<completed_operation> completed;
+        std::unique_ptr<keytab_state_cache> cache;
+        if(vm.count("cache-dir"))
+            cache.reset(new keytab_state_cache(vm["cache-dir"].as<string>()));
 
-        context ctx;
+        const context & ctx = context_pool::instance().acquire();
+        entry_filter filter;
+        if(!parse_filter(ctx, vm, filter))
+            return 1;
+        filter.set_use_index(vm.count("index") != 0);
+        const entry_filter * selection = filter.empty() ? NULL : &filter;
+        // results of filtered operations are cached separately
+        const string filter_suffix = selection ? " " + filter.description() : string();
         if( vm.count("version"))
         {
             cout << appName << " version " << TARGET_VERSION << " (" << TARGET_DISTRIBUTION << ")" << endl;
         }
+        else if(watch && !vm.count("update"))
+        {
+            // a copy would add all source entries again on every change
+            cerr << "--watch requires --update." << endl;
+            ret = 1;
+        }
+        else if( vm.count("recursive"))
+        {
+            const bool list = vm.count("list") != 0;
+            const bool check = vm.count("check") != 0;
+            output_format format;
+            unsigned fields = output_field_default;
+            if(!list && !check && !expunge && !compact)
+            {
+                cerr << "--recursive requires --list, --check, --expunge or --compact." << endl;
+                return 1;
+            }
+            if((list && !vm["list"].as< vector<string> >().empty()) || (check && !vm["check"].as< vector<string> >().empty())
+               || (expunge && !vm["expunge"].as< vector<string> >().empty()) || !compact_filenames.empty())
+            {
+                cerr << "Keytab files cannot be combined with --recursive." << endl;
+                return 1;
+            }
+            if(!parse_output_format(vm["format"].as<string>(), format))
+            {
+                cerr << "Invalid output format " << vm["format"].as<string>() << endl;
+                return 1;
+            }
+            // the listing of many keytabs always identifies the keytab of every entry
+            if(format != output_format_text)
+                fields |= output_field_keytab;
+            if(vm.count("fields") && !parse_output_fields(vm["fields"].as<string>(), fields))
+            {
+                cerr << "Invalid list of fields " << vm["fields"].as<string>() << endl;
+                return 1;
+            }
+            entry_formatter list_formatter(format, fields);
+            health_formatter check_formatter(format);
+
+            directory_walker walker(vm["pattern"].as<string>());
+            const vector<string> & directories = vm["recursive"].as< vector<string> >();
+            for(vector<string>::const_iterator it = directories.begin(); it != directories.end(); ++it)
+                walker.add_root(*it);
+            tree_processor processor(list ? &list_formatter : NULL, check, expunge, compact, selection, cache.get(), filter_suffix);
+            bool walked = walker.run(vm["jobs"].as<unsigned>(), processor);
+            ret = report_tree(processor.results(), list ? &list_formatter : NULL, check ? &check_formatter : NULL, expunge, compact);
+            for(tree_processor::result_map::const_iterator it = processor.results().begin(); it != processor.results().end(); ++it)
+            {
+                if(it->second.error.empty() && !it->second.listed.operation.empty())
+                    completed.push_back(it->second.listed);
+            }
+            if(!walked)
+            {
+                for(vector<string>::const_iterator it = walker.errors().begin(); it != walker.errors().end(); ++it)
+                    cerr << "Failed to read directory " << *it << endl;
+                ret = 2;
+            }
+            // all keytabs have already been expunged and compacted
+            expunge = false;
+            compact = false;
+        }
         else if ( vm.count("list") )
         {
             vector<string> filenames = vm["list"].as< vector<string> >();
             if(filenames.empty())
                 filenames.push_back(SYSTEM_KEYTAB);
 
-            for(vector<string>::const_iterator it = filenames.begin(); it != filenames.end(); ++it)
+            output_format format;
+            unsigned fields = output_field_default;
+            if(!parse_output_format(vm["format"].as<string>(), format))
             {
-                const string & filename = *it;
-                keytab kt(ctx, filename);
-                cout << "Keytab name: FILE:" << filename << endl;
-                sorted_list_handler sorted_handler;
-                kt.list<sorted_list_handler>(sorted_handler);
-                console_list_handler handler;
-                sorted_handler.list<console_list_handler>(handler);
-                if(expunge)
-                    expunge_filenames.push_back(filename);
+                cerr << "Invalid output format " << vm["format"].as<string>() << endl;
+                return 1;
+            }
+            // machine readable formats identify the keytab of every entry
+            if(format != output_format_text)
+                fields |= output_field_keytab;
+            if(vm.count("fields") && !parse_output_fields(vm["fields"].as<string>(), fields))
+            {
+                cerr << "Invalid list of fields " << vm["fields"].as<string>() << endl;
+                return 1;
+            }
+            entry_formatter formatter(format, fields);
+            output_buffer out(STDOUT_FILENO);
+            formatter.header(out);
+
+            unsigned jobs = vm["jobs"].as<unsigned>();
+            if(jobs > 1 && filenames.size() > 1)
+            {
+                parallel_lister lister(filenames, formatter, selection, cache.get());
+                if(!lister.run(jobs, out))
+                    ret = 2;
+                else if(expunge)
+                    expunge_filenames = filenames;
+                completed.insert(completed.end(), lister.completed().begin(), lister.completed().end());
+            }
+            else
+            {
+                for(vector<string>::const_iterator it = filenames.begin(); it != filenames.end(); ++it)
+                {
+                    const string & filename = *it;
+                    completed_operation listed;
+                    list_keytab(ctx, filename, formatter, out, selection, cache.get(), NULL, &listed);
+                    if(!listed.operation.empty())
+                        completed.push_back(listed);
+                    if(expunge)
+                        expunge_filenames.push_back(filename);
+                }
             }
+            out.flush();
+            if(out.failed())
+                ret = 2;
         }
-        else if( vm.count("update"))
+        else if( vm.count("update") || vm.count("copy"))
         {
-            vector<string> filenames = vm["update"].as< vector<string> >();
+            const bool copy = !vm.count("update");
+            const string action = copy ? "copy" : "update";
+            vector<string> filenames = vm[action].as< vector<string> >();
             string source = (filenames.size() >= 1) ? filenames[0] : string();
-            string dest = (filenames.size() >= 2) ? filenames[1] : string();
 
             if(source.empty())
             {
                 cerr << "No source keytab file given." << endl;
                 ret = 1;
             }
-            else if(dest.empty())
+            else if(filenames.size() < 2)
             {
                 cerr << "No destination keytab file given." << endl;
                 ret = 1;
             }
-            else if(source == dest)
+            else if(std::find(filenames.begin() + 1, filenames.end(), source) != filenames.end())
             {
                 cerr << "Source and destination keytab file (" << source << ") are identical." << endl;
                 ret = 1;
             }
+            else if(watch)
+                ret = watch_keytabs(ctx, filenames, expunge, vm["watch-delay"].as<unsigned>(), verbose, selection);
             else
             {
-                keytab sourceKeyTab(ctx, source);
-                keytab destKeyTab(ctx, dest);
-                if(destKeyTab.update(sourceKeyTab))
-                    ret = 0;
-                else
-                    ret = 2;
-                if(expunge)
-                    expunge_filenames.push_back(dest);
+                const string operation = (expunge ? action + "+expunge" : action) + filter_suffix;
+                vector<string> destinations;
+                const vector<string>::const_iterator first = filenames.begin() + 1;
+                for(vector<string>::const_iterator it = first; it != filenames.end(); ++it)
+                {
+                    // two workers must never write the same destination
+                    if(std::find(first, it, *it) != it)
+                        continue;
+                    vector<string> keytabs;
+                    keytabs.push_back(source);
+                    keytabs.push_back(*it);
+                    if(cache && cache->lookup(operation, keytabs))
+                    {
+                        if(verbose)
+                            cout << action << " " << source << " -> " << *it << ": unchanged" << endl;
+                    }
+                    else
+                        destinations.push_back(*it);
+                }
+                if(!destinations.empty())
+                {
+                    // the state of the source is recorded before it is read
+                    keytab_state_cache::state source_state;
+                    if(cache)
+                        cache->capture(source_state, source, false);
+                    // the source is read only once for all destinations
+                    keytab sourceKeyTab(ctx, source);
+                    sourceKeyTab.set_filter(selection);
+                    keytab_snapshot snapshot;
+                    sourceKeyTab.snapshot(snapshot);
+                    parallel_updater updater(snapshot, destinations, copy);
+                    if(!updater.run(vm["jobs"].as<unsigned>()))
+                        ret = 2;
+                    for(size_t i = 0; i < destinations.size(); ++i)
+                    {
+                        if(!updater.succeeded(i))
+                            continue;
+                        if(expunge)
+                            expunge_filenames.push_back(destinations[i]);
+                        compact_filenames.push_back(destinations[i]);
+                        if(cache)
+                        {
+                            completed_operation c;
+                            c.operation = operation;
+                            c.state = source_state;
+                            cache->capture(c.state, destinations[i], true);
+                            completed.push_back(c);
+                        }
+                    }
+                }
             }
         }
-        else if( vm.count("copy"))
+        else if( vm.count("merge"))
         {
-            vector<string> filenames = vm["copy"].as< vector<string> >();
-            string source = (filenames.size() >= 1) ? filenames[0] : string();
-            string dest = (filenames.size() >= 2) ? filenames[1] : string();
-
-            if(source.empty())
+            vector<string> filenames = vm["merge"].as< vector<string> >();
+            if(filenames.empty())
+            {
+                cerr << "No destination keytab file given." << endl;
+                ret = 1;
+            }
+            else if(filenames.size() < 2)
             {
                 cerr << "No source keytab file given." << endl;
                 ret = 1;
             }
-            else if(dest.empty())
+            else if(std::find(filenames.begin() + 1, filenames.end(), filenames.front()) != filenames.end())
             {
-                cerr << "No destination keytab file given." << endl;
+                cerr << "Source and destination keytab file (" << filenames.front() << ") are identical." << endl;
                 ret = 1;
             }
-            else if(source == dest)
+            else
             {
-                cerr << "Source and destination keytab file (" << source << ") are identical." << endl;
+                const string operation = (expunge ? "merge+expunge" : "merge") + filter_suffix;
+                const string & dest = filenames.front();
+                if(cache && cache->lookup(operation, filenames))
+                {
+                    if(verbose)
+                        cout << "merge " << dest << ": unchanged" << endl;
+                }
+                else
+                {
+                    // the state of the sources is recorded before they are read
+                    completed_operation c;
+                    c.operation = operation;
+                    if(cache)
+                    {
+                        cache->capture(c.state, dest, true);
+                        for(vector<string>::const_iterator it = filenames.begin() + 1; it != filenames.end(); ++it)
+                            cache->capture(c.state, *it, false);
+                    }
+                    // read all sources in parallel and write the destination once
+                    const vector<string> sources(filenames.begin() + 1, filenames.end());
+                    parallel_loader loader(sources, selection);
+                    if(!loader.run(vm["jobs"].as<unsigned>()))
+                        ret = 2;
+                    else
+                    {
+                        keytab destKeyTab(ctx, dest);
+                        if(destKeyTab.update(loader.snapshots()))
+                        {
+                            if(expunge)
+                                expunge_filenames.push_back(dest);
+                            compact_filenames.push_back(dest);
+                            if(cache)
+                                completed.push_back(c);
+                        }
+                        else
+                            ret = 2;
+                    }
+                }
+            }
+        }
+        else if( vm.count("diff"))
+        {
+            vector<string> filenames = vm["diff"].as< vector<string> >();
+            output_format format;
+            if(filenames.size() != 2)
+            {
+                cerr << "Two keytab files required." << endl;
+                ret = 1;
+            }
+            else if(!parse_output_format(vm["format"].as<string>(), format))
+            {
+                cerr << "Invalid output format " << vm["format"].as<string>() << endl;
                 ret = 1;
             }
             else
             {
-                keytab sourceKeyTab(ctx, source);
-                keytab destKeyTab(ctx, dest);
-                if(destKeyTab.copy(sourceKeyTab))
-                    ret = 0;
+                keytab from(ctx, filenames[0]);
+                keytab to(ctx, filenames[1]);
+                from.set_filter(selection);
+                to.set_filter(selection);
+                vector<keytab_difference> differences;
+                if(!diff_keytabs(from, to, differences))
+                    ret = 2;
                 else
+                {
+                    difference_formatter formatter(format);
+                    output_buffer out(STDOUT_FILENO);
+                    formatter.header(out);
+                    for(vector<keytab_difference>::const_iterator it = differences.begin(); it != differences.end(); ++it)
+                        formatter(out, *it);
+                    out.flush();
+                    if(out.failed())
+                        ret = 2;
+                    else if(!differences.empty())
+                        ret = 1;
+                }
+            }
+        }
+        else if( vm.count("get") || vm.count("exists"))
+        {
+            const bool get = vm.count("get") != 0;
+            vector<string> filenames = vm[get ? "get" : "exists"].as< vector<string> >();
+            output_format format;
+            unsigned fields = output_field_default;
+            if(filenames.size() < 2)
+            {
+                cerr << "A keytab file and at least one principal required." << endl;
+                ret = 1;
+            }
+            else if(!parse_output_format(vm["format"].as<string>(), format))
+            {
+                cerr << "Invalid output format " << vm["format"].as<string>() << endl;
+                ret = 1;
+            }
+            else if(vm.count("fields") && !parse_output_fields(vm["fields"].as<string>(), fields))
+            {
+                cerr << "Invalid list of fields " << vm["fields"].as<string>() << endl;
+                ret = 1;
+            }
+            else
+            {
+                const vector<string> principals(filenames.begin() + 1, filenames.end());
+                if(format != output_format_text)
+                    fields |= output_field_keytab;
+                entry_formatter formatter(format, fields);
+                output_buffer out(STDOUT_FILENO);
+                if(get)
+                    formatter.header(out);
+                // the index is also used without any other filter criteria
+                ret = find_principals(ctx, filenames.front(), principals, formatter, out, get,
+                                      filter.use_index() ? &filter : selection);
+                out.flush();
+                if(out.failed())
+                    ret = 2;
+            }
+        }
+        else if( vm.count("check"))
+        {
+            vector<string> filenames = vm["check"].as< vector<string> >();
+            if(filenames.empty())
+                filenames.push_back(SYSTEM_KEYTAB);
+            output_format format;
+            if(!parse_output_format(vm["format"].as<string>(), format))
+            {
+                cerr << "Invalid output format " << vm["format"].as<string>() << endl;
+                return 1;
+            }
+            health_formatter formatter(format);
+            output_buffer out(STDOUT_FILENO);
+            formatter.header(out);
+            for(vector<string>::const_iterator it = filenames.begin(); it != filenames.end(); ++it)
+            {
+                keytab kt(ctx, *it);
+                kt.set_filter(selection);
+                keytab_health health;
+                check_keytab(kt, health);
+                formatter(out, *it, health);
+                if(health.status() == keytab_health::failed)
                     ret = 2;
-                if(expunge)
-                    expunge_filenames.push_back(dest);
+                else if(health.status() == keytab_health::warning && !ret)
+                    ret = 1;
             }
+            out.flush();
+            if(out.failed())
+                ret = 2;
         }
         else if( vm.count("expunge"))
         {
@@ -264,17 +1306,25 @@ int main(int argc, char ** argv)
             }
             else
             {
-                vector<string>::const_iterator it = filenames.begin();
-                string keytabFilename = *it;
-                ++it;
+                string keytabFilename = filenames.front();
+                vector<string> principals(filenames.begin() + 1, filenames.end());
                 keytab keytab(ctx, keytabFilename);
+                keytab.set_filter(selection);
 
                 ret = 0;
-                for(; it != filenames.end(); ++it)
-                {
-                    if(!keytab.remove(*it))
-                        ret = 2;
-                }
+                // with a filter and no principals all matching entries are removed
+                if((!principals.empty() || selection) && !keytab.remove(principals))
+                    ret = 2;
+                else
+                    compact_filenames.push_back(keytabFilename);
+            }
+        }
+        else if( vm.count("compact"))
+        {
+            if(compact_filenames.empty())
+            {
+                cerr << "No keytab file given." << endl;
+                ret = 1;
             }
         }
         else
@@ -287,16 +1337,71 @@ int main(int argc, char ** argv)
             ret = 0;
             for(vector<string>::const_iterator it = expunge_filenames.begin(); it != expunge_filenames.end(); ++it)
             {
+                const vector<string> keytabs(1, *it);
+                const string operation = "expunge" + filter_suffix;
+                if(cache && cache->lookup(operation, keytabs))
+                    continue;
                 keytab keytab(ctx, *it);
+                keytab.set_filter(selection);
                 cout << "expunge " << *it << endl;
                 if(!keytab.expunge())
                     ret = 2;
+                compact_filenames.push_back(*it);
+                if(cache)
+                {
+                    completed_operation c;
+                    c.operation = operation;
+                    cache->capture(c.state, *it, true);
+                    completed.push_back(c);
+                }
+            }
+        }
+        if(!ret && compact)
+        {
+            vector<string> compacted;
+            for(vector<string>::const_iterator it = compact_filenames.begin(); it != compact_filenames.end(); ++it)
+            {
+                if(std::find(compacted.begin(), compacted.end(), *it) != compacted.end())
+                    continue;
+                compacted.push_back(*it);
+                keytab keytab(ctx, *it);
+                size_t reclaimed = 0;
+                if(!keytab.compact(reclaimed))
+                    ret = 2;
+                cout << "compact " << *it << ": " << reclaimed << " bytes reclaimed" << endl;
+            }
+        }
+        if(!ret && cache)
+        {
+            for(vector<completed_operation>::const_iterator it = completed.begin(); it != completed.end(); ++it)
+            {
+                int err = cache->store(it->operation, it->state, it->result);
+                if(err)
+                    cerr << "Failed to save the state of " << it->operation << " in " << vm["cache-dir"].as<string>() << ": " << strerror(err) << endl;
             }
         }
     }
     catch(error & e)
     {
         cerr << "Kerberos error " << e.code() << ": " << e.what() << endl;
+        ret = 2;
+    }
+    if(audit)
+    {
+        audit_log::install(NULL);
+        int err = audit->close();
+        if(err)
+        {
+            cerr << "Failed to write the audit log " << vm["audit-log"].as<string>() << ": " << strerror(err) << endl;
+            ret = 2;
+        }
+    }
+    if(!stats_format.empty())
+    {
+        statistics::values values;
+        statistics::get(values);
+        output_buffer out(STDERR_FILENO);
+        format_statistics(out, values, statistics::now() - started, stats_format == "json");
     }
 
     return ret;
@@ -0,0 +1,453 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/classification.hpp>
+#include "opts_helper.h"
+#include "krb5_wrapper.h"
+#include "keytab_file.h"
+
+using namespace std;
+using namespace arsoft::krb5;
+
+namespace {
+
+// splitmix64, so the generated keytabs only depend on the seed
+class random_generator
+{
+    uint64_t _state;
+public:
+    random_generator(uint64_t seed) : _state(seed) {}
+    uint64_t next()
+    {
+        uint64_t z = (_state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+};
+
+struct generator_options {
+    size_t entries;
+    unsigned kvnos;             // key versions per principal and enctype
+    unsigned kvno_offset;       // first key version
+    unsigned principal_offset;  // first principal number
+    std::vector<int> enctypes;
+    std::string realm;
+    uint64_t seed;
+};
+
+const char * const services[] = { "host", "HTTP", "nfs", "cifs", "ldap" };
+
+size_t key_length(int enctype)
+{
+    switch(enctype)
+    {
+    case 17: // aes128-cts-hmac-sha1-96
+    case 23: // arcfour-hmac
+    case 19: // aes128-cts-hmac-sha256-128
+        return 16;
+    case 16: // des3-cbc-sha1
+        return 24;
+    default:
+        return 32;
+    }
+}
+
+// Writes a deterministic FILE: keytab with the given number of entries. The
+// entries are grouped by principal, and every principal gets opts.kvnos key
+// versions for each of the given enctypes.
+int generate_keytab(const std::string & filename, const generator_options & opts)
+{
+    unlink(filename.c_str());
+    keytab_file_writer writer;
+    int err = writer.open(filename);
+    if(err)
+        return err;
+
+    random_generator rnd(opts.seed);
+    size_t per_principal = opts.kvnos * opts.enctypes.size();
+    std::string service;
+    std::string host;
+    std::string key;
+    keytab_file_entry entry;
+    entry.components.resize(2);
+    entry.realm.data = opts.realm.data();
+    entry.realm.length = opts.realm.size();
+    entry.name_type = 1; // KRB5_NT_PRINCIPAL
+    for(size_t i = 0; i < opts.entries; ++i)
+    {
+        size_t principal = opts.principal_offset + i / per_principal;
+        size_t n = i % per_principal;
+        if(n == 0)
+        {
+            service = services[principal % (sizeof(services) / sizeof(services[0]))];
+            std::ostringstream os;
+            os << "node" << std::setw(7) << std::setfill('0') << principal << ".example.com";
+            host = os.str();
+            entry.components[0].data = service.data();
+            entry.components[0].length = service.size();
+            entry.components[1].data = host.data();
+            entry.components[1].length = host.size();
+        }
+        entry.vno = opts.kvno_offset + n / opts.enctypes.size();
+        entry.enctype = opts.enctypes[n % opts.enctypes.size()];
+        entry.timestamp = 1500000000 + (int32_t)(entry.vno * 86400);
+        key.resize(key_length(entry.enctype));
+        for(size_t k = 0; k < key.size(); k += sizeof(uint64_t))
+        {
+            uint64_t r = rnd.next();
+            memcpy(&key[k], &r, std::min(sizeof(r), key.size() - k));
+        }
+        entry.key.data = key.data();
+        entry.key.length = key.size();
+        writer.add(entry);
+    }
+    return writer.commit();
+}
+
+struct count_handler {
+    size_t count;
+    count_handler() : count(0) {}
+    void operator()(const keytab_entry &) { ++count; }
+};
+
+struct measurement {
+    double seconds;
+    long peak_rss_kb;
+    bool ok;
+};
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Runs the operation in a child process, so the peak RSS reported by the
+// kernel only covers this operation.
+template<typename OPERATION>
+measurement measure(OPERATION op)
+{
+    measurement m = { 0, 0, false };
+    int fds[2];
+    if(pipe(fds) != 0)
+        return m;
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        close(fds[0]);
+        bool ok = false;
+        double start = now();
+        try
+        {
+            ok = op();
+        }
+        catch(error & e)
+        {
+            cerr << "Kerberos error " << e.code() << ": " << e.what() << endl;
+        }
+        double elapsed = now() - start;
+        if(!ok)
+            elapsed = -1;
+        ssize_t written = write(fds[1], &elapsed, sizeof(elapsed));
+        _exit(written == sizeof(elapsed) ? 0 : 1);
+    }
+    close(fds[1]);
+    if(pid < 0)
+    {
+        close(fds[0]);
+        return m;
+    }
+    double elapsed = -1;
+    ssize_t got = read(fds[0], &elapsed, sizeof(elapsed));
+    close(fds[0]);
+    int status = 0;
+    struct rusage usage;
+    if(wait4(pid, &status, 0, &usage) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0 && got == sizeof(elapsed) && elapsed >= 0)
+    {
+        m.seconds = elapsed;
+        m.peak_rss_kb = usage.ru_maxrss;
+        m.ok = true;
+    }
+    return m;
+}
+
+bool copy_file(const std::string & from, const std::string & to)
+{
+    boost::system::error_code ec;
+    boost::filesystem::copy_file(from, to, boost::filesystem::copy_option::overwrite_if_exists, ec);
+    if(ec)
+        cerr << "Failed to copy " << from << " to " << to << ": " << ec.message() << endl;
+    return !ec;
+}
+
+// a run which could not even be prepared
+measurement failed_run()
+{
+    measurement m = { 0, 0, false };
+    return m;
+}
+
+// prints the best and mean time of the runs of an operation; returns false
+// if any of the runs failed
+bool report(const std::string & op, size_t size, size_t entries, const std::vector<measurement> & runs)
+{
+    double best = -1;
+    double total = 0;
+    long rss = 0;
+    size_t ok = 0;
+    bool all = true;
+    for(std::vector<measurement>::const_iterator it = runs.begin(); it != runs.end(); ++it)
+    {
+        if(!it->ok)
+        {
+            all = false;
+            continue;
+        }
+        ++ok;
+        total += it->seconds;
+        if(best < 0 || it->seconds < best)
+            best = it->seconds;
+        rss = std::max(rss, it->peak_rss_kb);
+    }
+    cout << std::left << std::setw(10) << size << std::setw(10) << op;
+    if(!ok)
+    {
+        cout << "failed" << endl;
+        return false;
+    }
+    double mean = total / ok;
+    cout << std::right << std::fixed << std::setprecision(3)
+         << std::setw(12) << best * 1000.0
+         << std::setw(12) << mean * 1000.0
+         << std::setw(16) << std::setprecision(0) << (best > 0 ? entries / best : 0)
+         << std::setw(14) << rss << endl;
+    return all;
+}
+
+} // namespace
+
+int main(int argc, char ** argv)
+{
+    std::string appName = boost::filesystem::basename(argv[0]);
+
+    namespace po = boost::program_options;
+    po::options_description desc("Options");
+    desc.add_options()
+      ("help,h", "Print help messages")
+      ("generate,g", po::value<string>(), "only write a synthetic keytab with the given name")
+      ("entries,n", po::value<size_t>()->default_value(1000), "number of entries of the generated keytab")
+      ("sizes,s", po::value<string>()->default_value("1000,10000,100000"), "comma separated keytab sizes for the benchmark")
+      ("kvnos,k", po::value<unsigned>()->default_value(2), "key versions per principal and enctype")
+      ("enctypes,e", po::value<string>()->default_value("18,17"), "comma separated list of enctype numbers")
+      ("realm", po::value<string>()->default_value("EXAMPLE.COM"), "realm of the generated principals")
+      ("seed", po::value<uint64_t>()->default_value(1), "seed for the generated keys")
+      ("iterations,i", po::value<unsigned>()->default_value(3), "number of runs per operation")
+      ("dir,d", po::value<string>()->default_value("."), "directory for the generated keytabs")
+      ;
+
+    po::variables_map vm;
+    try
+    {
+        po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+        if(vm.count("help"))
+        {
+            arsoft::OptionPrinter::printStandardAppDesc(appName, std::cout, desc);
+            return 0;
+        }
+        po::notify(vm);
+    }
+    catch(boost::program_options::error& e)
+    {
+        std::cerr << "ERROR: " << e.what() << std::endl << std::endl;
+        arsoft::OptionPrinter::printStandardAppDesc(appName, std::cout, desc);
+        return 1;
+    }
+
+    generator_options opts;
+    opts.entries = vm["entries"].as<size_t>();
+    opts.kvnos = std::max(1u, vm["kvnos"].as<unsigned>());
+    opts.kvno_offset = 1;
+    opts.principal_offset = 0;
+    opts.realm = vm["realm"].as<string>();
+    opts.seed = vm["seed"].as<uint64_t>();
+    std::vector<std::string> list;
+    boost::algorithm::split(list, vm["enctypes"].as<string>(), boost::algorithm::is_any_of(","), boost::algorithm::token_compress_on);
+    for(std::vector<std::string>::const_iterator it = list.begin(); it != list.end(); ++it)
+    {
+        if(!it->empty())
+            opts.enctypes.push_back(atoi(it->c_str()));
+    }
+    if(!opts.entries)
+    {
+        cerr << "The keytab needs at least one entry." << endl;
+        return 1;
+    }
+    if(opts.enctypes.empty())
+    {
+        cerr << "No enctypes given." << endl;
+        return 1;
+    }
+
+    if(vm.count("generate"))
+    {
+        int err = generate_keytab(vm["generate"].as<string>(), opts);
+        if(err)
+        {
+            cerr << "Failed to write " << vm["generate"].as<string>() << ": " << strerror(err) << endl;
+            return 2;
+        }
+        return 0;
+    }
+
+    std::vector<size_t> sizes;
+    boost::algorithm::split(list, vm["sizes"].as<string>(), boost::algorithm::is_any_of(","), boost::algorithm::token_compress_on);
+    for(std::vector<std::string>::const_iterator it = list.begin(); it != list.end(); ++it)
+    {
+        size_t size = strtoul(it->c_str(), NULL, 10);
+        if(size)
+            sizes.push_back(size);
+    }
+    unsigned iterations = std::max(1u, vm["iterations"].as<unsigned>());
+    std::string dir = vm["dir"].as<string>();
+
+    cout << std::left << std::setw(10) << "entries" << std::setw(10) << "operation"
+         << std::right << std::setw(12) << "best ms" << std::setw(12) << "mean ms"
+         << std::setw(16) << "entries/s" << std::setw(14) << "peak RSS kB" << endl;
+
+    int ret = 0;
+    for(std::vector<size_t>::const_iterator it = sizes.begin(); it != sizes.end(); ++it)
+    {
+        const size_t size = *it;
+        std::ostringstream prefix;
+        prefix << dir << "/akt-bench-" << size;
+        const std::string base = prefix.str() + ".keytab";
+        const std::string newer = prefix.str() + "-newer.keytab";
+        const std::string work = prefix.str() + "-work.keytab";
+
+        // the base keytab and a keytab with the next key versions of the
+        // second half of the principals and some new principals
+        generator_options base_opts = opts;
+        base_opts.entries = size;
+        generator_options newer_opts = opts;
+        newer_opts.entries = size;
+        newer_opts.seed = opts.seed + 1;
+        newer_opts.kvno_offset = opts.kvnos + 1;
+        newer_opts.principal_offset = size / (opts.kvnos * opts.enctypes.size()) / 2;
+        int err = generate_keytab(base, base_opts);
+        if(!err)
+            err = generate_keytab(newer, newer_opts);
+        if(err)
+        {
+            cerr << "Failed to generate keytabs in " << dir << ": " << strerror(err) << endl;
+            return 2;
+        }
+
+        std::vector<std::string> principals;
+        size_t principal_count = (size + opts.kvnos * opts.enctypes.size() - 1) / (opts.kvnos * opts.enctypes.size());
+        for(size_t p = 0; p < principal_count; p += 10)
+        {
+            std::ostringstream os;
+            os << services[p % (sizeof(services) / sizeof(services[0]))] << "/node"
+               << std::setw(7) << std::setfill('0') << p << ".example.com@" << opts.realm;
+            principals.push_back(os.str());
+        }
+
+        std::vector<measurement> runs;
+        for(unsigned i = 0; i < iterations; ++i)
+            runs.push_back(measure([&]() {
+                keytab kt(base);
+                count_handler handler;
+                return kt.list(handler) && handler.count == size;
+            }));
+        if(!report("list", size, size, runs))
+            ret = 2;
+
+        runs.clear();
+        for(unsigned i = 0; i < iterations; ++i)
+        {
+            unlink(work.c_str());
+            runs.push_back(measure([&]() {
+                keytab source(base);
+                keytab dest(work);
+                return dest.copy(source);
+            }));
+        }
+        if(!report("copy", size, size, runs))
+            ret = 2;
+
+        runs.clear();
+        for(unsigned i = 0; i < iterations; ++i)
+        {
+            if(!copy_file(base, work))
+            {
+                runs.push_back(failed_run());
+                continue;
+            }
+            runs.push_back(measure([&]() {
+                keytab source(newer);
+                keytab dest(work);
+                return dest.update(source);
+            }));
+        }
+        if(!report("update", size, 2 * size, runs))
+            ret = 2;
+
+        runs.clear();
+        for(unsigned i = 0; i < iterations; ++i)
+        {
+            bool prepared = copy_file(base, work);
+            if(prepared)
+            {
+                keytab source(newer);
+                keytab dest(work);
+                prepared = dest.update(source);
+            }
+            if(!prepared)
+            {
+                runs.push_back(failed_run());
+                continue;
+            }
+            runs.push_back(measure([&]() {
+                keytab kt(work);
+                return kt.expunge();
+            }));
+        }
+        if(!report("expunge", size, size + size / 2, runs))
+            ret = 2;
+
+        runs.clear();
+        for(unsigned i = 0; i < iterations; ++i)
+        {
+            if(!copy_file(base, work))
+            {
+                runs.push_back(failed_run());
+                continue;
+            }
+            runs.push_back(measure([&]() {
+                keytab kt(work);
+                return kt.remove(principals);
+            }));
+        }
+        if(!report("remove", size, size, runs))
+            ret = 2;
+        unlink(base.c_str());
+        unlink(newer.c_str());
+        unlink(work.c_str());
+    }
+    return ret;
+}
@@ -0,0 +1,275 @@
+#include "audit_log.h"
+#include "formatter.h"
+#include <krb5.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdio.h>
+#include <chrono>
+
+namespace arsoft {
+    namespace krb5 {
+
+namespace {
+
+// appends the data to the principal name with the same escapes as krb5_unparse_name()
+void append_escaped(std::string & name, const data_view & data, bool component)
+{
+    for(size_t i = 0; i < data.length; ++i)
+    {
+        char c = data.data[i];
+        switch(c)
+        {
+        case '/':
+            if(component)
+                name += '\\';
+            name += c;
+            break;
+        case '@':
+        case '\\':
+            name += '\\';
+            name += c;
+            break;
+        case '\n': name += "\\n"; break;
+        case '\t': name += "\\t"; break;
+        case '\b': name += "\\b"; break;
+        case '\0': name += "\\0"; break;
+        default: name += c; break;
+        }
+    }
+}
+
+// writes value with exactly the given number of (zero padded) digits
+void write_fixed(output_buffer & out, uint64_t value, unsigned base, size_t width)
+{
+    static const char digits[] = "0123456789abcdef";
+    char buf[24];
+    for(size_t i = width; i > 0; --i)
+    {
+        buf[i - 1] = digits[value % base];
+        value /= base;
+    }
+    out.write(buf, width);
+}
+
+// Formats the event times; the date and time of the last second is reused
+// since a burst of events usually happens within the same second.
+class time_writer
+{
+    time_t _second;
+    char _prefix[32];
+
+public:
+    time_writer() : _second(-1) { _prefix[0] = 0; }
+
+    void operator()(output_buffer & out, int64_t usec)
+    {
+        time_t t = (time_t)(usec / 1000000);
+        if(t != _second)
+        {
+            struct tm tm;
+            if(!gmtime_r(&t, &tm) || !strftime(_prefix, sizeof(_prefix), "%Y-%m-%dT%H:%M:%S", &tm))
+                _prefix[0] = 0;
+            _second = t;
+        }
+        out.write(_prefix);
+        out.put('.');
+        write_fixed(out, (uint64_t)(usec % 1000000), 10, 6);
+        out.put('Z');
+    }
+};
+
+} // namespace
+
+std::atomic<audit_log*> audit_log::_installed(NULL);
+
+audit_log::audit_log(const std::string & filename, size_t capacity, unsigned sync_interval)
+    : _filename(filename), _sync_interval(sync_interval), _fd(-1)
+    , _head(0), _tail(0), _stop(false), _error(0)
+{
+    // the positions are mapped to slots with a mask
+    size_t size = 2;
+    while(size < capacity)
+        size <<= 1;
+    std::vector<slot> slots(size);
+    _slots.swap(slots);
+    _mask = size - 1;
+    for(size_t i = 0; i < size; ++i)
+        _slots[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+audit_log::~audit_log()
+{
+    close();
+}
+
+int audit_log::open()
+{
+    _fd = ::open(_filename.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if(_fd < 0)
+        return errno;
+    _stop = false;
+    _error = 0;
+    _writer = std::thread(&audit_log::run, this);
+    return 0;
+}
+
+int audit_log::close()
+{
+    if(_writer.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(_wakeup_mutex);
+            _stop = true;
+        }
+        _wakeup.notify_one();
+        _writer.join();
+    }
+    if(_fd >= 0)
+    {
+        if(::close(_fd) != 0 && !_error)
+            _error = errno;
+        _fd = -1;
+    }
+    return _error;
+}
+
+void audit_log::record(operation op, const std::string & keytab, const keytab_file_entry & entry)
+{
+    // claim the next free slot (bounded MPMC queue as described by Dmitry Vyukov)
+    size_t pos = _head.load(std::memory_order_relaxed);
+    slot * s;
+    for(;;)
+    {
+        s = &_slots[pos & _mask];
+        size_t seq = s->sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if(diff == 0)
+        {
+            if(_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if(diff < 0)
+        {
+            // the ring is full: wait for the writer instead of losing the event
+            _wakeup.notify_one();
+            std::this_thread::yield();
+            pos = _head.load(std::memory_order_relaxed);
+        }
+        else
+            pos = _head.load(std::memory_order_relaxed);
+    }
+
+    event & e = s->e;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    e.op = op;
+    e.time = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    e.vno = entry.vno;
+    e.enctype = entry.enctype;
+    // the strings of a slot keep their capacity, so this rarely allocates
+    e.keytab.assign(keytab);
+    e.principal.clear();
+    for(std::vector<data_view>::const_iterator it = entry.components.begin(); it != entry.components.end(); ++it)
+    {
+        if(it != entry.components.begin())
+            e.principal += '/';
+        append_escaped(e.principal, *it, true);
+    }
+    e.principal += '@';
+    append_escaped(e.principal, entry.realm, false);
+
+    s->sequence.store(pos + 1, std::memory_order_release);
+    _wakeup.notify_one();
+}
+
+void audit_log::run()
+{
+    typedef std::chrono::steady_clock clock;
+    const unsigned long pid = (unsigned long)getpid();
+    const size_t size = _slots.size();
+    output_buffer out(_fd, 64*1024);
+    bool unsynced = false;
+    clock::time_point last_sync = clock::now();
+    time_writer write_time;
+    // the quoted name (or number) of the last enctype
+    int32_t last_enctype = 0;
+    std::string enctype_name;
+    char buf[64];
+
+    for(;;)
+    {
+        bool stop = _stop.load(std::memory_order_acquire);
+        size_t written = 0;
+        for(;;)
+        {
+            slot & s = _slots[_tail & _mask];
+            if(s.sequence.load(std::memory_order_acquire) != _tail + 1)
+                break;
+            const event & e = s.e;
+            out.write("{\"time\":\"");
+            write_time(out, e.time);
+            out.write("\",\"pid\":");
+            out.write_number(pid);
+            out.write(e.op == operation_add ? ",\"op\":\"add\",\"keytab\":" : ",\"op\":\"remove\",\"keytab\":");
+            write_json_string(out, e.keytab);
+            out.write(",\"principal\":");
+            write_json_string(out, e.principal);
+            out.write(",\"kvno\":");
+            out.write_number(e.vno);
+            out.write(",\"enctype\":");
+            if(enctype_name.empty() || e.enctype != last_enctype)
+            {
+                if(krb5_enctype_to_name(e.enctype, false, buf, sizeof(buf)) == 0)
+                    enctype_name = std::string("\"") + buf + "\"";
+                else
+                {
+                    snprintf(buf, sizeof(buf), "%d", (int)e.enctype);
+                    enctype_name = buf;
+                }
+                last_enctype = e.enctype;
+            }
+            out.write(enctype_name);
+            out.write("}\n", 2);
+            // hand the slot back to the producers
+            s.sequence.store(_tail + size, std::memory_order_release);
+            ++_tail;
+            ++written;
+        }
+        if(written)
+        {
+            out.flush();
+            if(out.failed() && !_error)
+                _error = errno ? errno : EIO;
+            unsynced = true;
+        }
+
+        // sync at most once per interval, so a burst of events costs one fsync
+        clock::time_point now = clock::now();
+        clock::time_point next_sync = last_sync + std::chrono::milliseconds(_sync_interval);
+        if(unsynced && (stop || now >= next_sync))
+        {
+            if(fdatasync(_fd) != 0 && !_error)
+                _error = errno;
+            unsynced = false;
+            last_sync = now;
+        }
+        if(stop)
+            break;
+
+        if(!written)
+        {
+            // the producers only notify without the mutex, so never sleep for long
+            clock::duration timeout = std::chrono::milliseconds(100);
+            if(unsynced && next_sync - now < timeout)
+                timeout = next_sync - now;
+            std::unique_lock<std::mutex> lock(_wakeup_mutex);
+            if(!_stop)
+                _wakeup.wait_for(lock, timeout);
+        }
+    }
+}
+
+    } // namespace krb5
+} // namespace arsoft
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+#include "keytab_file.h"
+
+namespace arsoft {
+    namespace krb5 {
+
+// Asynchronous audit log of all entries added to or removed from keytabs,
+// written as JSON Lines (principal, kvno, enctype and operation). Nothing
+// derived from the key is written: even a hash of a weak key (e.g. RC4, which
+// is derived from the password) would allow to guess the password offline.
+//
+// Events are queued in a bounded lock-free ring buffer, so recording an event
+// only copies a few strings and never waits for I/O. A background thread
+// appends the events to the log file and syncs the file at most once per
+// sync interval (and when the log is closed), so a burst of modifications
+// costs a few large writes and a single fsync. If the ring buffer is full,
+// record() waits for the writer rather than dropping events.
+class audit_log
+{
+public:
+    enum operation {
+        operation_add,
+        operation_remove
+    };
+
+    explicit audit_log(const std::string & filename, size_t capacity=4096, unsigned sync_interval=1000);
+    ~audit_log();
+
+    // opens the log file for appending and starts the writer thread; returns
+    // zero on success or an errno value
+    int open();
+    // writes and syncs all queued events and stops the writer thread; returns
+    // zero or the errno value of the first failed write
+    int close();
+
+    // queues an event; can be called from any number of threads
+    void record(operation op, const std::string & keytab, const keytab_file_entry & entry);
+
+    // the log which records all modifications of keytabs in this process
+    static void install(audit_log * log) { _installed = log; }
+    static audit_log * installed() { return _installed; }
+
+private:
+    struct event {
+        operation op;
+        int64_t time;
+        uint32_t vno;
+        int32_t enctype;
+        std::string keytab;
+        std::string principal;
+    };
+    struct slot {
+        // the position of the slot in the queue while it is free, one more
+        // once the producer has filled it
+        std::atomic<size_t> sequence;
+        event e;
+    };
+
+    std::string _filename;
+    unsigned _sync_interval;
+    int _fd;
+    std::vector<slot> _slots;
+    size_t _mask;
+    std::atomic<size_t> _head;          // next position to fill
+    size_t _tail;                       // next position to write, only used by the writer
+    std::atomic<bool> _stop;
+    std::atomic<int> _error;
+    std::mutex _wakeup_mutex;
+    std::condition_variable _wakeup;
+    std::thread _writer;
+
+    static std::atomic<audit_log*> _installed;
+
+    audit_log(const audit_log & rhs);
+    audit_log & operator=(const audit_log & rhs);
+
+    void run();
+};
+
+    } // namespace krb5
+} // namespace arsoft
@@ -0,0 +1,169 @@
+#include "directory_walker.h"
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <errno.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <string.h>
+#include <sys/stat.h>
+
+namespace arsoft {
+    namespace krb5 {
+
+directory_walker::directory_walker(const std::string & pattern, size_t batch_size)
+    : _pattern(pattern), _batch_size(batch_size ? batch_size : 1), _pending(0)
+{
+}
+
+void directory_walker::add_root(const std::string & directory)
+{
+    _roots.push_back(directory);
+}
+
+void directory_walker::push(size_t worker, const task & t)
+{
+    ++_pending;
+    {
+        std::lock_guard<std::mutex> lock(_queues[worker]->mutex);
+        _queues[worker]->tasks.push_back(t);
+    }
+    _idle_cond.notify_one();
+}
+
+bool directory_walker::pop(size_t worker, task & t)
+{
+    // the own queue is used as a stack (depth first, good locality) ...
+    {
+        worker_queue & own = *_queues[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if(!own.tasks.empty())
+        {
+            t = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    // ... while other workers steal the oldest tasks, which usually are the
+    // largest directories
+    for(size_t i = 1; i < _queues.size(); ++i)
+    {
+        worker_queue & other = *_queues[(worker + i) % _queues.size()];
+        std::lock_guard<std::mutex> lock(other.mutex);
+        if(!other.tasks.empty())
+        {
+            t = std::move(other.tasks.front());
+            other.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void directory_walker::read_directory(size_t worker, const std::string & path)
+{
+    DIR * dir = opendir(path.c_str());
+    if(!dir)
+    {
+        int err = errno;
+        std::lock_guard<std::mutex> lock(_errors_mutex);
+        _errors.push_back(path + ": " + strerror(err));
+        return;
+    }
+    const std::string prefix = (!path.empty() && path[path.size() - 1] == '/') ? path : path + '/';
+    // collect the entries first, so the directory is closed before any
+    // of them is processed
+    std::vector<std::string> directories;
+    std::vector<std::string> files;
+    struct dirent * entry;
+    while((entry = readdir(dir)) != NULL)
+    {
+        const char * name = entry->d_name;
+        if(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+        unsigned char type = entry->d_type;
+        std::string child = prefix + name;
+        if(type == DT_UNKNOWN || type == DT_LNK)
+        {
+            // links are followed for files, but not for directories
+            struct stat st;
+            if(lstat(child.c_str(), &st) != 0)
+                continue;
+            if(S_ISDIR(st.st_mode))
+                type = DT_DIR;
+            else if(S_ISLNK(st.st_mode))
+                type = (stat(child.c_str(), &st) == 0 && S_ISREG(st.st_mode)) ? DT_REG : DT_LNK;
+            else if(S_ISREG(st.st_mode))
+                type = DT_REG;
+        }
+        if(type == DT_DIR)
+            directories.push_back(child);
+        else if(type == DT_REG && fnmatch(_pattern.c_str(), name, 0) == 0)
+            files.push_back(child);
+    }
+    closedir(dir);
+
+    task t;
+    for(size_t i = 0; i < files.size(); i += _batch_size)
+    {
+        const size_t end = std::min(files.size(), i + _batch_size);
+        t.files.assign(files.begin() + i, files.begin() + end);
+        push(worker, t);
+    }
+    t.files.clear();
+    for(std::vector<std::string>::const_iterator it = directories.begin(); it != directories.end(); ++it)
+    {
+        t.directory = *it;
+        push(worker, t);
+    }
+}
+
+void directory_walker::worker(size_t index, file_handler & handler)
+{
+    task t;
+    while(_pending)
+    {
+        if(!pop(index, t))
+        {
+            // all queues are empty, but running tasks might queue more work
+            std::unique_lock<std::mutex> lock(_idle_mutex);
+            _idle_cond.wait_for(lock, std::chrono::milliseconds(5));
+            continue;
+        }
+        if(!t.directory.empty())
+            read_directory(index, t.directory);
+        else
+            handler(t.files);
+        if(--_pending == 0)
+            _idle_cond.notify_all();
+    }
+}
+
+bool directory_walker::run(unsigned jobs, file_handler & handler)
+{
+    if(jobs < 1)
+        jobs = 1;
+    for(unsigned i = 0; i < jobs; ++i)
+        _queues.push_back(new worker_queue);
+    for(size_t i = 0; i < _roots.size(); ++i)
+    {
+        task t;
+        t.directory = _roots[i].empty() ? "." : _roots[i];
+        push(i % jobs, t);
+    }
+
+    std::vector<std::thread> threads;
+    for(unsigned i = 1; i < jobs; ++i)
+        threads.push_back(std::thread(&directory_walker::worker, this, i, std::ref(handler)));
+    worker(0, handler);
+    for(std::vector<std::thread>::iterator it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+
+    for(std::vector<worker_queue*>::iterator it = _queues.begin(); it != _queues.end(); ++it)
+        delete *it;
+    _queues.clear();
+    return _errors.empty();
+}
+
+    } // namespace krb5
+} // namespace arsoft
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+namespace arsoft {
+    namespace krb5 {
+
+// Walks directory trees on a pool of worker threads and passes the files
+// whose names match a glob pattern to a handler, in batches of up to
+// batch_size files of the same directory. Every worker has its own queue of
+// directories and batches; new work is queued locally and idle workers steal
+// from the other queues, so a single large directory is still processed by
+// all workers. A worker holds at most one directory open while reading it, and
+// the handler opens at most one batch of keytabs at a time, so the number of
+// workers and the batch size bound both the I/O concurrency and the number of
+// open files. Symbolic links to directories are not followed.
+class directory_walker
+{
+public:
+    struct file_handler {
+        // called concurrently from all workers
+        virtual void operator()(const std::vector<std::string> & paths) = 0;
+    };
+
+    explicit directory_walker(const std::string & pattern="*.keytab", size_t batch_size=32);
+
+    void add_root(const std::string & directory);
+
+    // returns false if any directory could not be read; the errors are
+    // available through errors()
+    bool run(unsigned jobs, file_handler & handler);
+    const std::vector<std::string> & errors() const { return _errors; }
+
+private:
+    struct task {
+        std::string directory;
+        std::vector<std::string> files;     // used if no directory is set
+    };
+    struct worker_queue {
+        std::mutex mutex;
+        std::deque<task> tasks;
+    };
+
+    std::string _pattern;
+    size_t _batch_size;
+    std::vector<std::string> _roots;
+    std::vector<worker_queue*> _queues;
+    std::atomic<size_t> _pending;       // queued or running tasks
+    std::mutex _idle_mutex;
+    std::condition_variable _idle_cond;
+    std::mutex _errors_mutex;
+    std::vector<std::string> _errors;
+
+    directory_walker(const directory_walker & rhs);
+    directory_walker & operator=(const directory_walker & rhs);
+
+    void push(size_t worker, const task & t);
+    bool pop(size_t worker, task & t);
+    void read_directory(size_t worker, const std::string & path);
+    void worker(size_t index, file_handler & handler);
+};
+
+    } // namespace krb5
+} // namespace arsoft
@@ -0,0 +1,270 @@
+#include "entry_filter.h"
+#include "statistics.h"
+#include <krb5.h>
+#include <fnmatch.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/classification.hpp>
+
+namespace arsoft {
+    namespace krb5 {
+
+namespace {
+
+bool parse_number(const std::string & s, uint32_t & value)
+{
+    if(s.empty() || s.find_first_not_of("0123456789") != std::string::npos)
+        return false;
+    errno = 0;
+    unsigned long v = strtoul(s.c_str(), NULL, 10);
+    if(errno || v > 0xffffffffUL)
+        return false;
+    value = (uint32_t)v;
+    return true;
+}
+
+bool parse_time(const std::string & s, int64_t & value)
+{
+    if(!s.empty() && s.find_first_not_of("0123456789") == std::string::npos)
+    {
+        value = strtoll(s.c_str(), NULL, 10);
+        return true;
+    }
+    static const char * const formats[] = {
+        "%Y-%m-%dT%H:%M:%SZ", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M:%S", "%Y-%m-%d"
+    };
+    for(size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i)
+    {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char * end = strptime(s.c_str(), formats[i], &tm);
+        if(end && *end == '\0')
+        {
+            value = timegm(&tm);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool data_equals(const krb5_data & data, const std::string & s)
+{
+    return data.length == s.size() && memcmp(data.data, s.data(), s.size()) == 0;
+}
+
+} // namespace
+
+entry_filter::entry_filter()
+    : _has_key_version(false), _min_key_version(0), _max_key_version(0),
+      _has_since(false), _has_until(false), _since(0), _until(0), _use_index(false)
+{
+}
+
+void entry_filter::describe(const char * name, const std::string & value)
+{
+    if(!_description.empty())
+        _description += ' ';
+    _description += name;
+    _description += '=';
+    _description += value;
+}
+
+bool entry_filter::add_principal(const context & ctx, const std::string & pattern)
+{
+    if(pattern.empty())
+        return false;
+    std::string p = pattern;
+    // just like keytab::remove(), a pattern without realm only matches the
+    // default realm
+    if(p.find('@') == std::string::npos)
+    {
+        char * realm = NULL;
+        if(krb5_get_default_realm(ctx, &realm) == 0)
+        {
+            p += '@';
+            p += realm;
+            krb5_free_default_realm(ctx, realm);
+        }
+        else
+            p += "@*";
+    }
+    _patterns.push_back(p);
+    describe("principal", p);
+    return true;
+}
+
+bool entry_filter::add_regex(const std::string & expression)
+{
+    try
+    {
+        _regexes.push_back(boost::regex(expression));
+    }
+    catch(boost::regex_error &)
+    {
+        return false;
+    }
+    describe("regex", expression);
+    return true;
+}
+
+void entry_filter::add_realm(const std::string & realm)
+{
+    _realms.push_back(realm);
+    describe("realm", realm);
+}
+
+void entry_filter::add_service(const std::string & service)
+{
+    _services.push_back(service);
+    describe("service", service);
+}
+
+bool entry_filter::add_enctypes(const std::string & names)
+{
+    std::vector<std::string> list;
+    boost::algorithm::split(list, names, boost::algorithm::is_any_of(","), boost::algorithm::token_compress_on);
+    for(std::vector<std::string>::const_iterator it = list.begin(); it != list.end(); ++it)
+    {
+        if(it->empty())
+            continue;
+        uint32_t number;
+        krb5_enctype enctype;
+        if(parse_number(*it, number))
+            enctype = (krb5_enctype)number;
+        else if(krb5_string_to_enctype(const_cast<char*>(it->c_str()), &enctype) != 0)
+            return false;
+        _enctypes.push_back(enctype);
+        describe("enctype", std::to_string(enctype));
+    }
+    return true;
+}
+
+bool entry_filter::set_key_version_range(const std::string & range)
+{
+    std::string::size_type pos = range.find('-');
+    uint32_t min = 0;
+    uint32_t max = 0xffffffff;
+    if(pos == std::string::npos)
+    {
+        if(!parse_number(range, min))
+            return false;
+        max = min;
+    }
+    else
+    {
+        std::string first = range.substr(0, pos);
+        std::string last = range.substr(pos + 1);
+        if(first.empty() && last.empty())
+            return false;
+        if(!first.empty() && !parse_number(first, min))
+            return false;
+        if(!last.empty() && !parse_number(last, max))
+            return false;
+        if(min > max)
+            return false;
+    }
+    _has_key_version = true;
+    _min_key_version = min;
+    _max_key_version = max;
+    describe("kvno", std::to_string(min) + '-' + std::to_string(max));
+    return true;
+}
+
+bool entry_filter::set_since(const std::string & time)
+{
+    if(!parse_time(time, _since))
+        return false;
+    _has_since = true;
+    describe("since", std::to_string(_since));
+    return true;
+}
+
+bool entry_filter::set_until(const std::string & time)
+{
+    if(!parse_time(time, _until))
+        return false;
+    _has_until = true;
+    describe("until", std::to_string(_until));
+    return true;
+}
+
+bool entry_filter::get_principal_keys(std::vector<std::string> & names, std::vector<std::string> & prefixes) const
+{
+    // regular expressions only restrict the entries further
+    if(_patterns.empty())
+        return false;
+    for(std::vector<std::string>::const_iterator it = _patterns.begin(); it != _patterns.end(); ++it)
+    {
+        std::string::size_type special = it->find_first_of("*?[\\");
+        if(special == std::string::npos)
+            names.push_back(*it);
+        else if(special == 0)
+            return false;
+        else
+            prefixes.push_back(it->substr(0, special));
+    }
+    return true;
+}
+
+bool entry_filter::match(krb5_context ctx, const krb5_keytab_entry & entry) const
+{
+    if(_has_key_version && (entry.vno < _min_key_version || entry.vno > _max_key_version))
+        return false;
+    if(!_enctypes.empty() && std::find(_enctypes.begin(), _enctypes.end(), entry.key.enctype) == _enctypes.end())
+        return false;
+    // timestamps are unsigned, just like in the list output
+    const int64_t ts = (uint32_t)entry.timestamp;
+    if(_has_since && ts < _since)
+        return false;
+    if(_has_until && ts > _until)
+        return false;
+
+    const krb5_principal_data * principal = entry.principal;
+    if(!_realms.empty())
+    {
+        bool found = false;
+        for(std::vector<std::string>::const_iterator it = _realms.begin(); !found && it != _realms.end(); ++it)
+            found = data_equals(principal->realm, *it);
+        if(!found)
+            return false;
+    }
+    if(!_services.empty())
+    {
+        if(principal->length < 1)
+            return false;
+        bool found = false;
+        for(std::vector<std::string>::const_iterator it = _services.begin(); !found && it != _services.end(); ++it)
+            found = data_equals(principal->data[0], *it);
+        if(!found)
+            return false;
+    }
+
+    if(_patterns.empty() && _regexes.empty())
+        return true;
+    char * name = NULL;
+    {
+        statistics::timer t(statistics::phase_unparse);
+        statistics::count(statistics::krb5_calls);
+        if(krb5_unparse_name(ctx, principal, &name) != 0)
+            return false;
+    }
+    // the patterns and the regular expressions are separate criteria
+    bool ret = _patterns.empty();
+    for(std::vector<std::string>::const_iterator it = _patterns.begin(); !ret && it != _patterns.end(); ++it)
+        ret = (fnmatch(it->c_str(), name, 0) == 0);
+    if(ret && !_regexes.empty())
+    {
+        ret = false;
+        for(std::vector<boost::regex>::const_iterator it = _regexes.begin(); !ret && it != _regexes.end(); ++it)
+            ret = boost::regex_search(name, *it);
+    }
+    krb5_free_unparsed_name(ctx, name);
+    return ret;
+}
+
+    } // namespace krb5
+} // namespace arsoft
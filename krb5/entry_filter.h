@@ -0,0 +1,78 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/regex.hpp>
+#include "krb5_wrapper.h"
+
+namespace arsoft {
+    namespace krb5 {
+
+// Selects keytab entries by principal (glob patterns or Perl-style regular
+// expressions, which match anywhere in the name unless anchored), realm,
+// service, enctype, kvno range and timestamp range. All criteria must match,
+// the glob patterns and the regular expressions being separate criteria;
+// within one criterion any of the given values may match.
+//
+// The filter is evaluated on the raw entries inside the scan loop of the
+// keytab: the cheap checks (kvno, enctype, timestamp, realm and service) come
+// first and the principal is only unparsed if a pattern or regular expression
+// has to be checked. A filter is not modified by match(), so it can be shared
+// by several threads.
+class entry_filter
+{
+public:
+    entry_filter();
+
+    // the add/set functions return false if the given value is invalid
+    bool add_principal(const context & ctx, const std::string & pattern);
+    bool add_regex(const std::string & expression);
+    void add_realm(const std::string & realm);
+    void add_service(const std::string & service);
+    // enctype names or numbers, separated by commas
+    bool add_enctypes(const std::string & names);
+    // N, N-M, N- or -M
+    bool set_key_version_range(const std::string & range);
+    // seconds since the epoch or an ISO 8601 date/time in UTC
+    bool set_since(const std::string & time);
+    bool set_until(const std::string & time);
+
+    // lets keytabs look up the entries matching the principal patterns in
+    // their keytab_index (which is built on first use) instead of scanning
+    // all entries
+    void set_use_index(bool use_index) { _use_index = use_index; }
+    bool use_index() const { return _use_index; }
+    // returns the principal names and name prefixes which every matching
+    // entry starts with; returns false if the principals are not restricted
+    // by glob patterns without leading wildcards
+    bool get_principal_keys(std::vector<std::string> & names, std::vector<std::string> & prefixes) const;
+
+    // returns true if no criteria has been given
+    bool empty() const { return _description.empty(); }
+    // canonical description of all criteria, e.g. to identify cached results
+    const std::string & description() const { return _description; }
+
+    bool match(krb5_context ctx, const krb5_keytab_entry & entry) const;
+
+private:
+    std::vector<std::string> _patterns;
+    std::vector<boost::regex> _regexes;
+    std::vector<std::string> _realms;
+    std::vector<std::string> _services;
+    std::vector<int32_t> _enctypes;
+    bool _has_key_version;
+    uint32_t _min_key_version;
+    uint32_t _max_key_version;
+    bool _has_since;
+    bool _has_until;
+    int64_t _since;
+    int64_t _until;
+    bool _use_index;
+    std::string _description;
+
+    void describe(const char * name, const std::string & value);
+};
+
+    } // namespace krb5
+} // namespace arsoft
@@ -0,0 +1,683 @@
+#include "formatter.h"
+#include "krb5_wrapper.h"
+#include "keytab_diff.h"
+#include "keytab_check.h"
+#include "statistics.h"
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <new>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/classification.hpp>
+
+namespace arsoft {
+    namespace krb5 {
+
+output_buffer::output_buffer(int fd, size_t size)
+    : _fd(fd), _target(NULL), _buffer(NULL), _size(size), _used(0), _failed(false)
+{
+    _buffer = static_cast<char*>(malloc(_size));
+    if(!_buffer)
+        throw std::bad_alloc();
+}
+
+output_buffer::output_buffer(std::string & target, size_t size)
+    : _fd(-1), _target(&target), _buffer(NULL), _size(size), _used(0), _failed(false)
+{
+    _buffer = static_cast<char*>(malloc(_size));
+    if(!_buffer)
+        throw std::bad_alloc();
+}
+
+output_buffer::~output_buffer()
+{
+    flush();
+    free(_buffer);
+}
+
+void output_buffer::write(const char * data, size_t size)
+{
+    if(size > _size - _used)
+    {
+        flush();
+        // large blocks do not need to be copied into the buffer
+        if(size >= _size)
+        {
+            write_out(data, size);
+            return;
+        }
+    }
+    memcpy(_buffer + _used, data, size);
+    _used += size;
+}
+
+void output_buffer::write(const char * s)
+{
+    write(s, strlen(s));
+}
+
+void output_buffer::write_number(unsigned long value)
+{
+    char buf[24];
+    char * p = buf + sizeof(buf);
+    do
+    {
+        *--p = (char)('0' + value % 10);
+        value /= 10;
+    }
+    while(value);
+    write(p, buf + sizeof(buf) - p);
+}
+
+void output_buffer::write_hex(unsigned long value)
+{
+    static const char digits[] = "0123456789abcdef";
+    char buf[24];
+    char * p = buf + sizeof(buf);
+    do
+    {
+        *--p = digits[value & 0xf];
+        value >>= 4;
+    }
+    while(value);
+    write(p, buf + sizeof(buf) - p);
+}
+
+void output_buffer::flush()
+{
+    write_out(_buffer, _used);
+    _used = 0;
+}
+
+void output_buffer::write_out(const char * data, size_t size)
+{
+    if(_target)
+        _target->append(data, size);
+    else
+    {
+        statistics::timer t(statistics::phase_output);
+        while(size && !_failed)
+        {
+            ssize_t written = ::write(_fd, data, size);
+            if(written < 0)
+            {
+                if(errno != EINTR)
+                    _failed = true;
+                continue;
+            }
+            data += written;
+            size -= written;
+        }
+    }
+}
+
+void write_json_string(output_buffer & out, const std::string & value)
+{
+    static const char digits[] = "0123456789abcdef";
+    out.put('"');
+    for(std::string::const_iterator it = value.begin(); it != value.end(); ++it)
+    {
+        unsigned char c = (unsigned char)*it;
+        if(c == '"' || c == '\\')
+        {
+            out.put('\\');
+            out.put((char)c);
+        }
+        else if(c < 0x20)
+        {
+            out.write("\\u00", 4);
+            out.put(digits[c >> 4]);
+            out.put(digits[c & 0xf]);
+        }
+        else
+            out.put((char)c);
+    }
+    out.put('"');
+}
+
+namespace {
+
+void write_iso_timestamp(output_buffer & out, const timestamp & ts)
+{
+    char buf[32];
+    time_t t = (time_t)(uint32_t)ts.value();
+    struct tm tm;
+    if(gmtime_r(&t, &tm) && strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm))
+        out.write(buf);
+}
+
+void write_encryption(output_buffer & out, const keytab_entry & entry)
+{
+    char buf[64];
+    if(entry.get_encryption_as_string(buf, sizeof(buf)))
+        out.write(buf);
+    else
+        out.write_number(entry.get_encryption());
+}
+
+// same output as the original console output of akt
+struct text_backend
+{
+    static void begin(output_buffer &) {}
+    static void end(output_buffer & out) { out.put('\n'); }
+    static void separator(output_buffer & out) { out.write(", ", 2); }
+    static void name(output_buffer &, const char *) {}
+    static void string_value(output_buffer & out, const std::string & value) { out.write(value); }
+    static void number_value(output_buffer & out, unsigned long value) { out.write_number(value); }
+    static void hex_value(output_buffer & out, unsigned long value) { out.write_hex(value); }
+    static void encryption_value(output_buffer & out, const keytab_entry & entry) { write_encryption(out, entry); }
+    static void timestamp_value(output_buffer & out, const timestamp & ts)
+    {
+        char buf[64];
+        if(ts.to_string(buf, sizeof(buf)))
+            out.write(buf);
+    }
+};
+
+struct tsv_backend
+{
+    static void begin(output_buffer &) {}
+    static void end(output_buffer & out) { out.put('\n'); }
+    static void separator(output_buffer & out) { out.put('\t'); }
+    static void name(output_buffer &, const char *) {}
+    static void string_value(output_buffer & out, const std::string & value)
+    {
+        for(std::string::const_iterator it = value.begin(); it != value.end(); ++it)
+        {
+            switch(*it)
+            {
+            case '\t': out.write("\\t", 2); break;
+            case '\n': out.write("\\n", 2); break;
+            case '\r': out.write("\\r", 2); break;
+            case '\\': out.write("\\\\", 2); break;
+            default: out.put(*it); break;
+            }
+        }
+    }
+    static void number_value(output_buffer & out, unsigned long value) { out.write_number(value); }
+    static void hex_value(output_buffer & out, unsigned long value) { out.write_hex(value); }
+    static void encryption_value(output_buffer & out, const keytab_entry & entry) { write_encryption(out, entry); }
+    static void timestamp_value(output_buffer & out, const timestamp & ts) { write_iso_timestamp(out, ts); }
+};
+
+struct csv_backend
+{
+    static void begin(output_buffer &) {}
+    static void end(output_buffer & out) { out.write("\r\n", 2); }
+    static void separator(output_buffer & out) { out.put(','); }
+    static void name(output_buffer &, const char *) {}
+    static void string_value(output_buffer & out, const std::string & value)
+    {
+        if(value.find_first_of(",\"\r\n") == std::string::npos)
+        {
+            out.write(value);
+            return;
+        }
+        out.put('"');
+        for(std::string::const_iterator it = value.begin(); it != value.end(); ++it)
+        {
+            if(*it == '"')
+                out.put('"');
+            out.put(*it);
+        }
+        out.put('"');
+    }
+    static void number_value(output_buffer & out, unsigned long value) { out.write_number(value); }
+    static void hex_value(output_buffer & out, unsigned long value) { out.write_hex(value); }
+    static void encryption_value(output_buffer & out, const keytab_entry & entry) { write_encryption(out, entry); }
+    static void timestamp_value(output_buffer & out, const timestamp & ts) { write_iso_timestamp(out, ts); }
+};
+
+struct jsonl_backend
+{
+    static void begin(output_buffer & out) { out.put('{'); }
+    static void end(output_buffer & out) { out.write("}\n", 2); }
+    static void separator(output_buffer & out) { out.put(','); }
+    static void name(output_buffer & out, const char * name)
+    {
+        out.put('"');
+        out.write(name);
+        out.write("\":", 2);
+    }
+    static void string_value(output_buffer & out, const std::string & value) { write_json_string(out, value); }
+    static void number_value(output_buffer & out, unsigned long value) { out.write_number(value); }
+    static void hex_value(output_buffer & out, unsigned long value)
+    {
+        out.put('"');
+        out.write_hex(value);
+        out.put('"');
+    }
+    static void encryption_value(output_buffer & out, const keytab_entry & entry)
+    {
+        out.put('"');
+        write_encryption(out, entry);
+        out.put('"');
+    }
+    static void timestamp_value(output_buffer & out, const timestamp & ts)
+    {
+        out.put('"');
+        write_iso_timestamp(out, ts);
+        out.put('"');
+    }
+};
+
+template<typename BACKEND>
+inline void begin_field(output_buffer & out, bool & first, const char * name)
+{
+    if(!first)
+        BACKEND::separator(out);
+    first = false;
+    BACKEND::name(out, name);
+}
+
+// FIELDS is a compile time constant, so all checks of the selected fields are
+// resolved by the compiler.
+template<typename BACKEND, unsigned FIELDS>
+void format_entry(output_buffer & out, const keytab_entry & entry,
+                  const std::string & principal_name, const std::string & keytab_name)
+{
+    if(!FIELDS)
+        return;
+    bool first = true;
+    BACKEND::begin(out);
+    if(FIELDS & output_field_keytab)
+    {
+        begin_field<BACKEND>(out, first, "keytab");
+        BACKEND::string_value(out, keytab_name);
+    }
+    if(FIELDS & output_field_magic)
+    {
+        begin_field<BACKEND>(out, first, "magic");
+        BACKEND::hex_value(out, (uint32_t)entry.get_magic());
+    }
+    if(FIELDS & output_field_principal)
+    {
+        begin_field<BACKEND>(out, first, "principal");
+        BACKEND::string_value(out, principal_name);
+    }
+    if(FIELDS & output_field_key_version)
+    {
+        begin_field<BACKEND>(out, first, "kvno");
+        BACKEND::number_value(out, (unsigned)entry.get_key_version());
+    }
+    if(FIELDS & output_field_encryption_type)
+    {
+        begin_field<BACKEND>(out, first, "enctype");
+        BACKEND::encryption_value(out, entry);
+    }
+    if(FIELDS & output_field_timestamp)
+    {
+        begin_field<BACKEND>(out, first, "timestamp");
+        BACKEND::timestamp_value(out, entry.get_timestamp());
+    }
+    BACKEND::end(out);
+}
+
+template<typename BACKEND, unsigned FIELDS>
+struct format_table
+{
+    static void fill(entry_formatter::format_function * table)
+    {
+        table[FIELDS] = &format_entry<BACKEND, FIELDS>;
+        format_table<BACKEND, FIELDS - 1>::fill(table);
+    }
+};
+
+template<typename BACKEND>
+struct format_table<BACKEND, 0>
+{
+    static void fill(entry_formatter::format_function * table)
+    {
+        table[0] = &format_entry<BACKEND, 0>;
+    }
+};
+
+template<typename BACKEND>
+entry_formatter::format_function select_function(unsigned fields)
+{
+    static entry_formatter::format_function table[output_field_all + 1];
+    static bool initialized = (format_table<BACKEND, output_field_all>::fill(table), true);
+    (void)initialized;
+    return table[fields & output_field_all];
+}
+
+const char * const change_names[] = { "added", "removed", "rekeyed", "timestamp" };
+
+// machine readable formats: the old timestamp is missing for added entries and
+// the new one for removed entries
+template<typename BACKEND>
+void format_difference(output_buffer & out, const keytab_difference & diff, bool omit_missing)
+{
+    bool first = true;
+    BACKEND::begin(out);
+    begin_field<BACKEND>(out, first, "change");
+    BACKEND::string_value(out, change_names[diff.change]);
+    begin_field<BACKEND>(out, first, "principal");
+    BACKEND::string_value(out, diff.principal);
+    begin_field<BACKEND>(out, first, "kvno");
+    BACKEND::number_value(out, diff.key_version);
+    begin_field<BACKEND>(out, first, "enctype");
+    BACKEND::string_value(out, diff.encryption_name);
+    if(diff.change != keytab_difference::added)
+    {
+        begin_field<BACKEND>(out, first, "old_timestamp");
+        BACKEND::timestamp_value(out, timestamp(diff.old_timestamp));
+    }
+    else if(!omit_missing)
+        begin_field<BACKEND>(out, first, "old_timestamp");
+    if(diff.change != keytab_difference::removed)
+    {
+        begin_field<BACKEND>(out, first, "timestamp");
+        BACKEND::timestamp_value(out, timestamp(diff.new_timestamp));
+    }
+    else if(!omit_missing)
+        begin_field<BACKEND>(out, first, "timestamp");
+    BACKEND::end(out);
+}
+
+// text format: one line per difference, prefixed with the kind of change
+void format_difference_text(output_buffer & out, const keytab_difference & diff)
+{
+    static const char prefixes[] = { '+', '-', '!', '~' };
+    out.put(prefixes[diff.change]);
+    out.put(' ');
+    out.write(diff.principal);
+    out.write(", ", 2);
+    out.write_number(diff.key_version);
+    out.write(", ", 2);
+    out.write(diff.encryption_name);
+    out.write(", ", 2);
+    if(diff.change != keytab_difference::added)
+        text_backend::timestamp_value(out, timestamp(diff.old_timestamp));
+    if(diff.change == keytab_difference::rekeyed || diff.change == keytab_difference::timestamp_changed)
+        out.write(" -> ", 4);
+    if(diff.change != keytab_difference::removed)
+        text_backend::timestamp_value(out, timestamp(diff.new_timestamp));
+    out.put('\n');
+}
+
+const char * const status_names[] = { "ok", "warning", "failed" };
+
+std::string mode_string(unsigned mode)
+{
+    char buf[8];
+    snprintf(buf, sizeof(buf), "%04o", mode & 07777);
+    return buf;
+}
+
+// machine readable formats: the error is missing for readable keytabs
+template<typename BACKEND>
+void format_health(output_buffer & out, const std::string & keytab_name, const keytab_health & health, bool omit_missing)
+{
+    bool first = true;
+    BACKEND::begin(out);
+    begin_field<BACKEND>(out, first, "keytab");
+    BACKEND::string_value(out, keytab_name);
+    begin_field<BACKEND>(out, first, "status");
+    BACKEND::string_value(out, status_names[health.status()]);
+    begin_field<BACKEND>(out, first, "entries");
+    BACKEND::number_value(out, health.entries);
+    begin_field<BACKEND>(out, first, "principals");
+    BACKEND::number_value(out, health.principals);
+    begin_field<BACKEND>(out, first, "obsolete");
+    BACKEND::number_value(out, health.obsolete);
+    begin_field<BACKEND>(out, first, "duplicates");
+    BACKEND::number_value(out, health.duplicates);
+    begin_field<BACKEND>(out, first, "weak");
+    BACKEND::number_value(out, health.weak);
+    begin_field<BACKEND>(out, first, "mode");
+    BACKEND::string_value(out, mode_string(health.mode));
+    if(!health.error.empty())
+    {
+        begin_field<BACKEND>(out, first, "error");
+        BACKEND::string_value(out, health.error);
+    }
+    else if(!omit_missing)
+        begin_field<BACKEND>(out, first, "error");
+    BACKEND::end(out);
+}
+
+// text format: one line per keytab with all problems found
+void format_health_text(output_buffer & out, const std::string & keytab_name, const keytab_health & health)
+{
+    out.write(keytab_name);
+    out.write(": ", 2);
+    switch(health.status())
+    {
+    case keytab_health::failed:
+        out.write("FAILED: ");
+        out.write(health.error);
+        break;
+    case keytab_health::warning:
+        {
+            out.write("WARNING:");
+            const char * separator = " ";
+            if(health.obsolete)
+            {
+                out.write(separator);
+                out.write_number(health.obsolete);
+                out.write(" obsolete");
+                separator = ", ";
+            }
+            if(health.duplicates)
+            {
+                out.write(separator);
+                out.write_number(health.duplicates);
+                out.write(" duplicated");
+                separator = ", ";
+            }
+            if(health.weak)
+            {
+                out.write(separator);
+                out.write_number(health.weak);
+                out.write(" weak");
+                separator = ", ";
+            }
+            if(health.insecure_mode())
+            {
+                out.write(separator);
+                out.write("mode ");
+                out.write(mode_string(health.mode));
+            }
+        }
+        break;
+    case keytab_health::healthy:
+    default:
+        out.write("OK");
+        break;
+    }
+    if(health.error.empty())
+    {
+        out.write(" (");
+        out.write_number(health.entries);
+        out.write(" entries, ");
+        out.write_number(health.principals);
+        out.write(" principals)");
+    }
+    out.put('\n');
+}
+
+struct field_name {
+    const char * name;
+    unsigned field;
+};
+
+const field_name field_names[] = {
+    { "keytab", output_field_keytab },
+    { "magic", output_field_magic },
+    { "principal", output_field_principal },
+    { "kvno", output_field_key_version },
+    { "enctype", output_field_encryption_type },
+    { "timestamp", output_field_timestamp },
+};
+
+} // namespace
+
+bool parse_output_format(const std::string & name, output_format & format)
+{
+    if(name == "text")
+        format = output_format_text;
+    else if(name == "tsv")
+        format = output_format_tsv;
+    else if(name == "csv")
+        format = output_format_csv;
+    else if(name == "jsonl" || name == "json")
+        format = output_format_jsonl;
+    else
+        return false;
+    return true;
+}
+
+bool parse_output_fields(const std::string & names, unsigned & fields)
+{
+    std::vector<std::string> list;
+    boost::algorithm::split(list, names, boost::algorithm::is_any_of(","), boost::algorithm::token_compress_on);
+    fields = 0;
+    for(std::vector<std::string>::const_iterator it = list.begin(); it != list.end(); ++it)
+    {
+        if(it->empty())
+            continue;
+        bool found = false;
+        for(size_t i = 0; !found && i < sizeof(field_names) / sizeof(field_names[0]); ++i)
+        {
+            if(*it == field_names[i].name)
+            {
+                fields |= field_names[i].field;
+                found = true;
+            }
+        }
+        if(*it == "all")
+            fields = output_field_all;
+        else if(!found)
+            return false;
+    }
+    return true;
+}
+
+entry_formatter::entry_formatter(output_format format, unsigned fields)
+    : _format(format), _fields(fields & output_field_all), _function(NULL)
+{
+    switch(_format)
+    {
+    case output_format_tsv: _function = select_function<tsv_backend>(_fields); break;
+    case output_format_csv: _function = select_function<csv_backend>(_fields); break;
+    case output_format_jsonl: _function = select_function<jsonl_backend>(_fields); break;
+    case output_format_text:
+    default: _function = select_function<text_backend>(_fields); break;
+    }
+}
+
+void entry_formatter::header(output_buffer & out) const
+{
+    if(_format != output_format_tsv && _format != output_format_csv)
+        return;
+    bool first = true;
+    for(size_t i = 0; i < sizeof(field_names) / sizeof(field_names[0]); ++i)
+    {
+        if(_fields & field_names[i].field)
+        {
+            if(!first)
+                out.put(_format == output_format_tsv ? '\t' : ',');
+            first = false;
+            out.write(field_names[i].name);
+        }
+    }
+    if(!first)
+        out.write(_format == output_format_tsv ? "\n" : "\r\n");
+}
+
+difference_formatter::difference_formatter(output_format format)
+    : _format(format)
+{
+}
+
+void difference_formatter::header(output_buffer & out) const
+{
+    if(_format == output_format_tsv)
+        out.write("change\tprincipal\tkvno\tenctype\told_timestamp\ttimestamp\n");
+    else if(_format == output_format_csv)
+        out.write("change,principal,kvno,enctype,old_timestamp,timestamp\r\n");
+}
+
+void difference_formatter::operator()(output_buffer & out, const keytab_difference & diff) const
+{
+    switch(_format)
+    {
+    case output_format_tsv: format_difference<tsv_backend>(out, diff, false); break;
+    case output_format_csv: format_difference<csv_backend>(out, diff, false); break;
+    case output_format_jsonl: format_difference<jsonl_backend>(out, diff, true); break;
+    case output_format_text:
+    default: format_difference_text(out, diff); break;
+    }
+}
+
+health_formatter::health_formatter(output_format format)
+    : _format(format)
+{
+}
+
+void health_formatter::header(output_buffer & out) const
+{
+    if(_format == output_format_tsv)
+        out.write("keytab\tstatus\tentries\tprincipals\tobsolete\tduplicates\tweak\tmode\terror\n");
+    else if(_format == output_format_csv)
+        out.write("keytab,status,entries,principals,obsolete,duplicates,weak,mode,error\r\n");
+}
+
+void health_formatter::operator()(output_buffer & out, const std::string & keytab_name, const keytab_health & health) const
+{
+    switch(_format)
+    {
+    case output_format_tsv: format_health<tsv_backend>(out, keytab_name, health, false); break;
+    case output_format_csv: format_health<csv_backend>(out, keytab_name, health, false); break;
+    case output_format_jsonl: format_health<jsonl_backend>(out, keytab_name, health, true); break;
+    case output_format_text:
+    default: format_health_text(out, keytab_name, health); break;
+    }
+}
+
+void format_statistics(output_buffer & out, const statistics::values & values, uint64_t elapsed, bool json)
+{
+    char buf[128];
+    if(json)
+    {
+        out.write("{\"elapsed_us\":");
+        out.write_number(elapsed / 1000);
+        out.write(",\"phases_us\":{");
+        for(int i = 0; i < statistics::phase_count; ++i)
+        {
+            if(i)
+                out.put(',');
+            jsonl_backend::name(out, statistics::name((statistics::phase)i));
+            out.write_number(values.phases[i] / 1000);
+        }
+        out.write("},\"counters\":{");
+        for(int i = 0; i < statistics::counter_count; ++i)
+        {
+            if(i)
+                out.put(',');
+            jsonl_backend::name(out, statistics::name((statistics::counter)i));
+            out.write_number(values.counters[i]);
+        }
+        out.write("}}\n");
+        return;
+    }
+    snprintf(buf, sizeof(buf), "%-16s %12.3f ms\n", "elapsed", elapsed / 1e6);
+    out.write(buf);
+    for(int i = 0; i < statistics::phase_count; ++i)
+    {
+        snprintf(buf, sizeof(buf), "%-16s %12.3f ms\n", statistics::name((statistics::phase)i), values.phases[i] / 1e6);
+        out.write(buf);
+    }
+    for(int i = 0; i < statistics::counter_count; ++i)
+    {
+        snprintf(buf, sizeof(buf), "%-16s %12llu\n", statistics::name((statistics::counter)i), (unsigned long long)values.counters[i]);
+        out.write(buf);
+    }
+}
+
+    } // namespace krb5
+} // namespace arsoft
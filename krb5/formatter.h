@@ -0,0 +1,143 @@
+#pragma once
+
+#include <string>
+#include <stddef.h>
+#include "statistics.h"
+
+namespace arsoft {
+    namespace krb5 {
+
+class keytab_entry;
+struct keytab_difference;
+struct keytab_health;
+
+// Collects output in a large buffer and writes it to a file descriptor (or
+// appends it to a string) only when the buffer is full or flushed.
+class output_buffer
+{
+    int _fd;
+    std::string * _target;
+    char * _buffer;
+    size_t _size;
+    size_t _used;
+    bool _failed;
+
+    output_buffer(const output_buffer & rhs);
+    output_buffer & operator=(const output_buffer & rhs);
+    void write_out(const char * data, size_t size);
+
+public:
+    explicit output_buffer(int fd, size_t size=256*1024);
+    explicit output_buffer(std::string & target, size_t size=64*1024);
+    ~output_buffer();
+
+    void write(const char * data, size_t size);
+    void write(const std::string & s) { write(s.data(), s.size()); }
+    void write(const char * s);
+    void put(char c)
+    {
+        if(_used == _size)
+            flush();
+        _buffer[_used++] = c;
+    }
+    void write_number(unsigned long value);
+    void write_hex(unsigned long value);
+    void flush();
+    // returns true if writing to the file descriptor failed
+    bool failed() const { return _failed; }
+};
+
+enum output_format {
+    output_format_text,
+    output_format_tsv,
+    output_format_csv,
+    output_format_jsonl
+};
+
+enum output_field {
+    output_field_principal = 0x01,
+    output_field_key_version = 0x02,
+    output_field_encryption_type = 0x04,
+    output_field_timestamp = 0x08,
+    output_field_magic = 0x10,
+    output_field_keytab = 0x20,
+    output_field_all = 0x3f,
+    output_field_default = output_field_principal|output_field_key_version|output_field_encryption_type|output_field_timestamp
+};
+
+// parses the name of an output format; returns false for unknown names
+bool parse_output_format(const std::string & name, output_format & format);
+// parses a comma separated list of field names; returns false for unknown names
+bool parse_output_fields(const std::string & names, unsigned & fields);
+
+// Formats keytab entries with a given set of fields. The set of fields and the
+// format are selected once: for every combination a specialized function is
+// instantiated at compile time, so formatting an entry does not check the
+// selected fields again.
+class entry_formatter
+{
+public:
+    typedef void (*format_function)(output_buffer & out, const keytab_entry & entry,
+                                    const std::string & principal_name, const std::string & keytab_name);
+
+    entry_formatter(output_format format=output_format_text, unsigned fields=output_field_default);
+
+    output_format format() const { return _format; }
+    unsigned fields() const { return _fields; }
+
+    // writes the column names for the TSV and CSV formats
+    void header(output_buffer & out) const;
+    void operator()(output_buffer & out, const keytab_entry & entry,
+                    const std::string & principal_name, const std::string & keytab_name) const
+    {
+        _function(out, entry, principal_name, keytab_name);
+    }
+
+private:
+    output_format _format;
+    unsigned _fields;
+    format_function _function;
+};
+
+// Formats the differences between two keytabs (see diff_keytabs()). Only the
+// principal, kvno, enctype and timestamps are written, never any key material.
+class difference_formatter
+{
+public:
+    difference_formatter(output_format format=output_format_text);
+
+    output_format format() const { return _format; }
+
+    // writes the column names for the TSV and CSV formats
+    void header(output_buffer & out) const;
+    void operator()(output_buffer & out, const keytab_difference & diff) const;
+
+private:
+    output_format _format;
+};
+
+// Formats the result of the health check of a keytab (see check_keytab()).
+class health_formatter
+{
+public:
+    health_formatter(output_format format=output_format_text);
+
+    output_format format() const { return _format; }
+
+    // writes the column names for the TSV and CSV formats
+    void header(output_buffer & out) const;
+    void operator()(output_buffer & out, const std::string & keytab_name, const keytab_health & health) const;
+
+private:
+    output_format _format;
+};
+
+// writes value as a quoted JSON string
+void write_json_string(output_buffer & out, const std::string & value);
+
+// writes the counters and phase times of a run which took elapsed nanoseconds,
+// as an aligned table or as a single JSON object (with times in microseconds)
+void format_statistics(output_buffer & out, const statistics::values & values, uint64_t elapsed, bool json);
+
+    } // namespace krb5
+} // namespace arsoft
@@ -0,0 +1,238 @@
+#include "keytab_cache.h"
+#include "keytab_file.h"
+#include <sstream>
+#include <fstream>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace arsoft {
+    namespace krb5 {
+
+namespace {
+
+const char state_magic[] = "akt-state 2";
+
+// keytabs modified within this number of seconds before their state has been
+// recorded are compared by content (coarse or skewed timestamps on NFS)
+const int64_t racy_window = 2;
+
+int write_all(int fd, const char * data, size_t size)
+{
+    while(size)
+    {
+        ssize_t written = ::write(fd, data, size);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return errno;
+        }
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+} // namespace
+
+keytab_state_cache::keytab_state_cache(const std::string & directory)
+    : _directory(directory)
+{
+}
+
+bool keytab_state_cache::keytab_path(const std::string & name, std::string & path)
+{
+    if(!get_file_keytab_path(name, path) || path.empty())
+        return false;
+    char resolved[PATH_MAX];
+    if(realpath(path.c_str(), resolved))
+        path = resolved;
+    else if(path[0] != '/')
+    {
+        char cwd[PATH_MAX];
+        if(!getcwd(cwd, sizeof(cwd)))
+            return false;
+        path = std::string(cwd) + '/' + path;
+    }
+    return true;
+}
+
+bool keytab_state_cache::get_state(const std::string & path, file_state & state)
+{
+    struct stat st;
+    memset(&state, 0, sizeof(state));
+    if(::stat(path.c_str(), &st) != 0)
+        return errno == ENOENT;
+    state.exists = true;
+    state.device = st.st_dev;
+    state.inode = st.st_ino;
+    state.size = st.st_size;
+    state.mtime = st.st_mtim.tv_sec;
+    state.mtime_nsec = st.st_mtim.tv_nsec;
+    return true;
+}
+
+int keytab_state_cache::record_state(const std::string & path, file_state & state)
+{
+    // the time is taken first: any later change of the keytab has a newer mtime
+    const int64_t now = time(NULL);
+    if(!get_state(path, state))
+        return errno;
+    // lookup() only compares the fingerprint of a keytab modified within the
+    // racy window, so any other keytab is not read here
+    if(state.exists && state.mtime >= now - racy_window && !get_file_fingerprint(path, state.fingerprint))
+        return errno;
+    state.recorded = now;
+    return 0;
+}
+
+std::string keytab_state_cache::state_filename(const std::string & operation, const std::vector<std::string> & keytabs) const
+{
+    uint64_t hash = fnv1a(fnv1a_basis, operation.c_str(), operation.size() + 1);
+    for(std::vector<std::string>::const_iterator it = keytabs.begin(); it != keytabs.end(); ++it)
+        hash = fnv1a(hash, it->c_str(), it->size() + 1);
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.state", (unsigned long long)hash);
+    return _directory + '/' + name;
+}
+
+bool keytab_state_cache::lookup(const std::string & operation, const std::vector<std::string> & keytabs, std::string & result) const
+{
+    std::vector<std::string> paths(keytabs.size());
+    for(size_t i = 0; i < keytabs.size(); ++i)
+    {
+        if(!keytab_path(keytabs[i], paths[i]))
+            return false;
+    }
+
+    std::ifstream in(state_filename(operation, paths).c_str(), std::ios::in | std::ios::binary);
+    if(!in)
+        return false;
+    std::string line;
+    if(!std::getline(in, line) || line != state_magic)
+        return false;
+    if(!std::getline(in, line) || line != "operation " + operation)
+        return false;
+
+    for(std::vector<std::string>::const_iterator it = paths.begin(); it != paths.end(); ++it)
+    {
+        if(!std::getline(in, line))
+            return false;
+        std::istringstream is(line);
+        std::string tag;
+        file_state recorded;
+        is >> tag >> recorded.exists >> recorded.device >> recorded.inode >> recorded.size
+           >> recorded.mtime >> recorded.mtime_nsec >> std::hex >> recorded.fingerprint
+           >> std::dec >> recorded.recorded;
+        std::string path;
+        if(!is || tag != "keytab" || is.get() != ' ' || !std::getline(is, path) || path != *it)
+            return false;
+
+        file_state current;
+        if(!get_state(*it, current) || current.exists != recorded.exists)
+            return false;
+        if(!current.exists)
+            continue;
+        if(current.device != recorded.device || current.inode != recorded.inode ||
+           current.size != recorded.size || current.mtime != recorded.mtime ||
+           current.mtime_nsec != recorded.mtime_nsec)
+            return false;
+        if(current.mtime >= recorded.recorded - racy_window)
+        {
+            if(!get_file_fingerprint(*it, current.fingerprint) || current.fingerprint != recorded.fingerprint)
+                return false;
+        }
+    }
+
+    size_t length = 0;
+    if(!std::getline(in, line) || sscanf(line.c_str(), "result %zu", &length) != 1)
+        return false;
+    result.resize(length);
+    if(length && !in.read(&result[0], length))
+        return false;
+    return true;
+}
+
+void keytab_state_cache::capture(state & s, const std::string & keytab, bool modified) const
+{
+    state::keytab k;
+    k.name = keytab;
+    k.modified = modified;
+    k.error = 0;
+    memset(&k.file, 0, sizeof(k.file));
+    // other keytab types cannot be checked for changes
+    if(!keytab_path(keytab, k.path))
+        s._supported = false;
+    else if(!modified)
+        k.error = record_state(k.path, k.file);
+    s._keytabs.push_back(k);
+}
+
+int keytab_state_cache::store(const std::string & operation, const std::vector<std::string> & keytabs, const std::string & result) const
+{
+    state s;
+    for(std::vector<std::string>::const_iterator it = keytabs.begin(); it != keytabs.end(); ++it)
+        capture(s, *it, true);
+    return store(operation, s, result);
+}
+
+int keytab_state_cache::store(const std::string & operation, const state & s, const std::string & result) const
+{
+    if(!s._supported)
+        return 0;
+
+    std::vector<std::string> paths;
+    std::ostringstream os;
+    os << state_magic << '\n'
+       << "operation " << operation << '\n';
+    for(std::vector<state::keytab>::const_iterator it = s._keytabs.begin(); it != s._keytabs.end(); ++it)
+    {
+        std::string path = it->path;
+        file_state current;
+        const file_state * recorded = &it->file;
+        if(it->error)
+            return it->error;
+        if(it->modified)
+        {
+            // a new keytab can only be resolved once it exists
+            if(!keytab_path(it->name, path))
+                return 0;
+            int err = record_state(path, current);
+            if(err)
+                return err;
+            recorded = &current;
+        }
+        os << "keytab " << recorded->exists << ' ' << recorded->device << ' ' << recorded->inode << ' '
+           << recorded->size << ' ' << recorded->mtime << ' ' << recorded->mtime_nsec << ' '
+           << std::hex << recorded->fingerprint << std::dec << ' ' << recorded->recorded << ' ' << path << '\n';
+        paths.push_back(path);
+    }
+    os << "result " << result.size() << '\n';
+    os.write(result.data(), result.size());
+    const std::string content = os.str();
+
+    if(mkdir(_directory.c_str(), 0700) != 0 && errno != EEXIST)
+        return errno;
+    const std::string filename = state_filename(operation, paths);
+    std::string tmpname = filename + ".XXXXXX";
+    int fd = mkstemp(&tmpname[0]);
+    if(fd < 0)
+        return errno;
+    int err = write_all(fd, content.data(), content.size());
+    if(::close(fd) != 0 && !err)
+        err = errno;
+    if(!err && rename(tmpname.c_str(), filename.c_str()) != 0)
+        err = errno;
+    if(err)
+        unlink(tmpname.c_str());
+    return err;
+}
+
+    } // namespace krb5
+} // namespace arsoft
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace arsoft {
+    namespace krb5 {
+
+// Persistent state of previous operations, used to skip operations on keytabs
+// which have not changed since the last run. For every operation (and set of
+// keytabs) a small state file in the cache directory records device, inode,
+// size, mtime and a content fingerprint of each keytab together with the
+// result of the operation. Keytabs which are only read are recorded as they
+// were before they have been read, so a change while the operation runs is
+// detected by the next lookup; modified keytabs are recorded after the
+// operation.
+//
+// As long as the recorded attributes match, the keytabs are not read at all.
+// Only if a keytab has been modified shortly before its state was recorded,
+// its content is compared with the fingerprint, because a change within the
+// granularity of the file system timestamps cannot be detected otherwise.
+class keytab_state_cache
+{
+    struct file_state {
+        bool exists;
+        uint64_t device;
+        uint64_t inode;
+        uint64_t size;
+        int64_t mtime;
+        long mtime_nsec;
+        uint64_t fingerprint;
+        int64_t recorded;       // time when the state has been recorded
+    };
+
+public:
+    // the keytabs of an operation and the recorded state of the keytabs
+    // which are read by the operation
+    class state
+    {
+        friend class keytab_state_cache;
+        struct keytab {
+            std::string name;
+            std::string path;
+            bool modified;          // recorded by store()
+            int error;
+            file_state file;
+        };
+        std::vector<keytab> _keytabs;
+        bool _supported;            // false if a keytab is not a FILE: keytab
+    public:
+        state() : _supported(true) {}
+        bool empty() const { return _keytabs.empty(); }
+    };
+
+    explicit keytab_state_cache(const std::string & directory);
+
+    // returns true if the given operation has been applied to the keytabs
+    // and none of the keytabs has changed since then. The stored result of
+    // the operation is returned in result.
+    bool lookup(const std::string & operation, const std::vector<std::string> & keytabs, std::string & result) const;
+    bool lookup(const std::string & operation, const std::vector<std::string> & keytabs) const
+    {
+        std::string result;
+        return lookup(operation, keytabs, result);
+    }
+    // adds the next keytab of an operation to the state. The state of a
+    // keytab which is only read is recorded right away, i.e. before the
+    // operation reads it; the state of a modified keytab is recorded by store().
+    void capture(state & s, const std::string & keytab, bool modified) const;
+    // saves the state of the keytabs after the given operation. Returns zero
+    // on success or an errno value.
+    int store(const std::string & operation, const state & s, const std::string & result=std::string()) const;
+    // saves the current state of the keytabs, which have all been modified
+    // by the operation
+    int store(const std::string & operation, const std::vector<std::string> & keytabs, const std::string & result=std::string()) const;
+
+private:
+    std::string _directory;
+
+    std::string state_filename(const std::string & operation, const std::vector<std::string> & keytabs) const;
+    static bool keytab_path(const std::string & name, std::string & path);
+    static bool get_state(const std::string & path, file_state & state);
+    // gets the state and, if the keytab has been modified within the racy
+    // window, its fingerprint; returns zero or an errno value
+    static int record_state(const std::string & path, file_state & state);
+};
+
+    } // namespace krb5
+} // namespace arsoft
@@ -0,0 +1,138 @@
+#include "keytab_check.h"
+#include "krb5_wrapper.h"
+#include "keytab_file.h"
+#include <sstream>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+namespace arsoft {
+    namespace krb5 {
+
+namespace {
+
+// DES, 3DES and RC4 are deprecated (RFC 6649, RFC 8429)
+bool is_weak_enctype(int enctype)
+{
+    switch(enctype)
+    {
+    case 1:     // des-cbc-crc
+    case 2:     // des-cbc-md4
+    case 3:     // des-cbc-md5
+    case 16:    // des3-cbc-sha1
+    case 23:    // arcfour-hmac
+    case 24:    // arcfour-hmac-exp
+        return true;
+    default:
+        return false;
+    }
+}
+
+struct group_state {
+    unsigned max_key_version;
+    size_t entries;
+};
+
+struct check_handler {
+    principal_table _table;
+    boost::unordered_map<std::string, group_state> _groups;    // by (principal, enctype)
+    boost::unordered_map<std::string, size_t> _keys;           // by (principal, enctype, kvno)
+    keytab_health & _health;
+    std::string _key;
+    check_handler(const context & ctx, keytab_health & health)
+        : _table(ctx), _health(health) {}
+
+    void operator()(const keytab_entry & e)
+    {
+        const unsigned id = _table.intern(e.get_principal());
+        const int encryption = e.get_encryption();
+        const unsigned key_version = e.get_key_version();
+        ++_health.entries;
+        if(is_weak_enctype(encryption))
+            ++_health.weak;
+
+        _key.clear();
+        _key.append(reinterpret_cast<const char*>(&id), sizeof(id));
+        _key.append(reinterpret_cast<const char*>(&encryption), sizeof(encryption));
+        group_state & g = _groups[_key];
+        if(g.entries == 0 || key_version > g.max_key_version)
+            g.max_key_version = key_version;
+        ++g.entries;
+
+        _key.append(reinterpret_cast<const char*>(&key_version), sizeof(key_version));
+        if(_keys[_key]++ > 0)
+            ++_health.duplicates;
+    }
+
+    // all entries of a group except the ones with the newest kvno are obsolete
+    void finish()
+    {
+        _health.principals = _table.size();
+        std::string key;
+        for(boost::unordered_map<std::string, group_state>::const_iterator it = _groups.begin(); it != _groups.end(); ++it)
+        {
+            key = it->first;
+            key.append(reinterpret_cast<const char*>(&it->second.max_key_version), sizeof(it->second.max_key_version));
+            boost::unordered_map<std::string, size_t>::const_iterator latest = _keys.find(key);
+            _health.obsolete += it->second.entries - latest->second;
+        }
+    }
+};
+
+} // namespace
+
+keytab_health::keytab_health()
+    : entries(0), principals(0), obsolete(0), duplicates(0), weak(0), mode(0)
+{
+}
+
+bool keytab_health::insecure_mode() const
+{
+    return (mode & (S_IRWXO | S_IWGRP)) != 0;
+}
+
+keytab_health::status_type keytab_health::status() const
+{
+    if(!error.empty())
+        return failed;
+    if(obsolete || duplicates || weak || insecure_mode())
+        return warning;
+    return healthy;
+}
+
+bool check_keytab(keytab & kt, keytab_health & health)
+{
+    health = keytab_health();
+    std::string path;
+    if(get_file_keytab_path(kt.get_filename(), path))
+    {
+        struct stat st;
+        if(stat(path.c_str(), &st) != 0)
+        {
+            health.error = strerror(errno);
+            return false;
+        }
+        health.mode = st.st_mode & 07777;
+    }
+    try
+    {
+        check_handler handler(kt.get_context(), health);
+        if(!kt.list(handler))
+        {
+            health.error = "Cannot open keytab";
+            return false;
+        }
+        handler.finish();
+    }
+    catch(error & e)
+    {
+        std::ostringstream os;
+        os << "Kerberos error " << e.code() << ": " << e.what();
+        health.error = os.str();
+        return false;
+    }
+    return true;
+}
+
+    } // namespace krb5
+} // namespace arsoft
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include <stddef.h>
+
+namespace arsoft {
+    namespace krb5 {
+
+class keytab;
+
+// Result of the health check of one keytab
+struct keytab_health
+{
+    enum status_type {
+        healthy,
+        warning,            // usable, but should be cleaned up or fixed
+        failed              // the keytab could not be read
+    };
+    size_t entries;
+    size_t principals;
+    size_t obsolete;        // entries with a newer kvno for the same principal and enctype
+    size_t duplicates;      // further entries with the same principal, kvno and enctype
+    size_t weak;            // entries with DES, 3DES or RC4 keys
+    unsigned mode;          // permission bits of the keytab file
+    std::string error;      // set if the keytab could not be read
+
+    keytab_health();
+    // the file is readable or writable by other users, or writable by the group
+    bool insecure_mode() const;
+    status_type status() const;
+};
+
+// Reads all entries of the keytab once and counts the entries which an
+// expunge would remove, duplicated entries and entries with weak enctypes.
+// Only entries matching the filter of the keytab are checked. The permissions
+// are checked if the keytab is a file. Returns false if the keytab could not
+// be read.
+bool check_keytab(keytab & kt, keytab_health & health);
+
+    } // namespace krb5
+} // namespace arsoft
@@ -0,0 +1,148 @@
+#include "keytab_diff.h"
+#include "krb5_wrapper.h"
+#include <algorithm>
+
+namespace arsoft {
+    namespace krb5 {
+
+namespace {
+
+struct entry_state {
+    unsigned principal;     // id in the principal table
+    unsigned key_version;
+    int encryption;
+    int32_t timestamp;
+    uint64_t fingerprint;
+    bool matched;
+};
+
+typedef boost::unordered_map<std::string, size_t> entry_map;
+typedef boost::unordered_map<int, std::string> encryption_names;
+
+// state of all entries of a keytab, indexed by (principal, kvno, enctype)
+struct keytab_state {
+    std::vector<entry_state> entries;
+    entry_map map;
+};
+
+// collects the state of all entries of a keytab; a later entry with the same
+// principal, kvno and enctype replaces the earlier one
+struct collect_handler {
+    principal_table & _table;
+    keytab_state & _state;
+    encryption_names & _names;
+    std::string _key;
+    collect_handler(principal_table & table, keytab_state & state, encryption_names & names)
+        : _table(table), _state(state), _names(names) {}
+
+    void operator()(const keytab_entry & e)
+    {
+        entry_state state;
+        state.principal = _table.intern(e.get_principal());
+        state.key_version = e.get_key_version();
+        state.encryption = e.get_encryption();
+        state.timestamp = e.get_timestamp().value();
+        state.fingerprint = e.get_key_fingerprint();
+        state.matched = false;
+
+        _key.clear();
+        _key.append(reinterpret_cast<const char*>(&state.principal), sizeof(state.principal));
+        _key.append(reinterpret_cast<const char*>(&state.key_version), sizeof(state.key_version));
+        _key.append(reinterpret_cast<const char*>(&state.encryption), sizeof(state.encryption));
+        std::pair<entry_map::iterator, bool> r = _state.map.insert(entry_map::value_type(_key, _state.entries.size()));
+        if(r.second)
+            _state.entries.push_back(state);
+        else
+            _state.entries[r.first->second] = state;
+        if(_names.find(state.encryption) == _names.end())
+            _names[state.encryption] = e.get_encryption_as_string();
+    }
+};
+
+} // namespace
+
+bool diff_keytabs(keytab & from, keytab & to, std::vector<keytab_difference> & differences)
+{
+    principal_table table(from.get_context());
+    keytab_state old_state;
+    keytab_state new_state;
+    encryption_names names;
+    std::vector<keytab_difference> found;
+    std::vector<unsigned> principals;
+
+    collect_handler collect_old(table, old_state, names);
+    if(!from.list(collect_old))
+        return false;
+    collect_handler collect_new(table, new_state, names);
+    if(!to.list(collect_new))
+        return false;
+
+    for(entry_map::const_iterator it = new_state.map.begin(); it != new_state.map.end(); ++it)
+    {
+        const entry_state & state = new_state.entries[it->second];
+        keytab_difference diff;
+        diff.key_version = state.key_version;
+        diff.encryption = state.encryption;
+        diff.encryption_name = names[state.encryption];
+        diff.old_timestamp = 0;
+        diff.new_timestamp = state.timestamp;
+
+        entry_map::const_iterator old_entry = old_state.map.find(it->first);
+        if(old_entry == old_state.map.end())
+            diff.change = keytab_difference::added;
+        else
+        {
+            entry_state & old = old_state.entries[old_entry->second];
+            old.matched = true;
+            diff.old_timestamp = old.timestamp;
+            if(old.fingerprint != state.fingerprint)
+                diff.change = keytab_difference::rekeyed;
+            else if(old.timestamp != state.timestamp)
+                diff.change = keytab_difference::timestamp_changed;
+            else
+                continue;
+        }
+        found.push_back(diff);
+        principals.push_back(state.principal);
+    }
+
+    // all entries of the old keytab without a match have been removed
+    for(size_t i = 0; i < old_state.entries.size(); ++i)
+    {
+        const entry_state & state = old_state.entries[i];
+        if(state.matched)
+            continue;
+        keytab_difference diff;
+        diff.change = keytab_difference::removed;
+        diff.key_version = state.key_version;
+        diff.encryption = state.encryption;
+        diff.encryption_name = names[state.encryption];
+        diff.old_timestamp = state.timestamp;
+        diff.new_timestamp = 0;
+        found.push_back(diff);
+        principals.push_back(state.principal);
+    }
+
+    std::vector<entry_sort_key> sorted(found.size());
+    for(unsigned i = 0; i < sorted.size(); ++i)
+    {
+        entry_sort_key & key = sorted[i];
+        key.principal_rank = table.rank(principals[i]);
+        key.key_version = found[i].key_version;
+        key.encryption = found[i].encryption;
+        key.index = i;
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    differences.clear();
+    differences.reserve(found.size());
+    for(std::vector<entry_sort_key>::const_iterator it = sorted.begin(); it != sorted.end(); ++it)
+    {
+        differences.push_back(found[it->index]);
+        differences.back().principal = table.name(principals[it->index]);
+    }
+    return true;
+}
+
+    } // namespace krb5
+} // namespace arsoft
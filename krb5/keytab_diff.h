@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace arsoft {
+    namespace krb5 {
+
+class keytab;
+
+struct keytab_difference
+{
+    enum change_type {
+        added,
+        removed,
+        rekeyed,            // same principal, kvno and enctype but another key
+        timestamp_changed
+    };
+    change_type change;
+    std::string principal;
+    unsigned key_version;
+    int encryption;
+    std::string encryption_name;
+    int32_t old_timestamp;  // not set for added entries
+    int32_t new_timestamp;  // not set for removed entries
+};
+
+// Compares two keytabs by (principal, kvno, enctype). Keys are only compared
+// by their fingerprint, so the differences never contain any key material.
+// Both keytabs are read once and the entries are matched through a hash
+// table, so the comparison takes linear time. If a keytab contains the same
+// (principal, kvno, enctype) more than once, the last entry is compared. The
+// differences are sorted by principal, kvno and enctype.
+bool diff_keytabs(keytab & from, keytab & to, std::vector<keytab_difference> & differences);
+
+    } // namespace krb5
+} // namespace arsoft
@@ -0,0 +1,597 @@
+#include "keytab_file.h"
+#include "statistics.h"
+#include "audit_log.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+namespace arsoft {
+    namespace krb5 {
+
+bool get_file_keytab_path(const std::string & name, std::string & path)
+{
+    std::string::size_type colon = name.find(':');
+    // names without a type prefix are handled as FILE: keytabs by libkrb5
+    if(colon == std::string::npos || name.find('/') < colon)
+    {
+        path = name;
+        return true;
+    }
+    std::string type = name.substr(0, colon);
+    if(type == "FILE" || type == "WRFILE")
+    {
+        path = name.substr(colon + 1);
+        return true;
+    }
+    return false;
+}
+
+uint64_t fnv1a(uint64_t hash, const void * data, size_t size)
+{
+    const unsigned char * p = static_cast<const unsigned char *>(data);
+    for(size_t i = 0; i < size; ++i)
+    {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+bool get_file_fingerprint(const std::string & path, uint64_t & fingerprint)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return false;
+    char buf[65536];
+    bool ret = true;
+    fingerprint = fnv1a_basis;
+    for(;;)
+    {
+        ssize_t got = ::read(fd, buf, sizeof(buf));
+        if(got < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            ret = false;
+            break;
+        }
+        if(got == 0)
+            break;
+        statistics::count(statistics::bytes_read, got);
+        fingerprint = fnv1a(fingerprint, buf, got);
+    }
+    ::close(fd);
+    return ret;
+}
+
+keytab_file_reader::keytab_file_reader()
+    : _data(NULL), _size(0), _pos(0), _version(0), _mapped(false), _failed(false)
+{
+}
+
+keytab_file_reader::~keytab_file_reader()
+{
+    close();
+}
+
+int keytab_file_reader::open(const std::string & filename)
+{
+    close();
+
+    int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return errno;
+    int err = open(fd);
+    ::close(fd);
+    return err;
+}
+
+int keytab_file_reader::open(int fd)
+{
+    close();
+
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+        return errno;
+    // an empty or truncated file does not contain a version number
+    if(!S_ISREG(st.st_mode) || st.st_size < 2)
+        return EINVAL;
+
+    void * data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED)
+        return errno;
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    statistics::count(statistics::bytes_read, st.st_size);
+
+    _data = static_cast<const unsigned char *>(data);
+    _size = st.st_size;
+    _mapped = true;
+    _version = (_data[0] << 8) | _data[1];
+    _pos = 2;
+    if(_version != version_1 && _version != version_2)
+    {
+        close();
+        return EINVAL;
+    }
+    return 0;
+}
+
+int keytab_file_reader::open(const char * data, size_t size)
+{
+    close();
+    if(size < 2)
+        return EINVAL;
+    _data = reinterpret_cast<const unsigned char *>(data);
+    _size = size;
+    _version = (_data[0] << 8) | _data[1];
+    _pos = 2;
+    if(_version != version_1 && _version != version_2)
+    {
+        close();
+        return EINVAL;
+    }
+    return 0;
+}
+
+void keytab_file_reader::close()
+{
+    if(_mapped)
+        munmap(const_cast<unsigned char *>(_data), _size);
+    _data = NULL;
+    _size = 0;
+    _pos = 0;
+    _version = 0;
+    _mapped = false;
+    _failed = false;
+}
+
+namespace {
+
+// Parses a single record of a keytab file. Version 0x501 stores all numbers in
+// host byte order, all later versions use network byte order.
+class record_parser
+{
+    const unsigned char * _data;
+    size_t _pos;
+    size_t _end;
+    int _version;
+
+public:
+    record_parser(const unsigned char * data, size_t pos, size_t end, int version)
+        : _data(data), _pos(pos), _end(end), _version(version) {}
+
+    size_t pos() const { return _pos; }
+
+    bool read_int16(int16_t & value)
+    {
+        if(_end - _pos < sizeof(value))
+            return false;
+        uint16_t v;
+        memcpy(&v, _data + _pos, sizeof(v));
+        _pos += sizeof(v);
+        value = (int16_t)((_version == keytab_file_reader::version_1) ? v : ntohs(v));
+        return true;
+    }
+
+    bool read_int32(int32_t & value)
+    {
+        if(_end - _pos < sizeof(value))
+            return false;
+        uint32_t v;
+        memcpy(&v, _data + _pos, sizeof(v));
+        _pos += sizeof(v);
+        value = (int32_t)((_version == keytab_file_reader::version_1) ? v : ntohl(v));
+        return true;
+    }
+
+    bool read_data(data_view & value)
+    {
+        int16_t length;
+        if(!read_int16(length) || length < 0 || _end - _pos < (size_t)length)
+            return false;
+        value.data = reinterpret_cast<const char *>(_data + _pos);
+        value.length = length;
+        _pos += length;
+        return true;
+    }
+
+    // parses the content of a record (following its size field)
+    bool parse(keytab_file_entry & entry)
+    {
+        int16_t count;
+        int16_t enctype;
+        int32_t value;
+        bool ok = read_int16(count);
+        // version 0x501 counts the realm as component
+        if(ok && _version == keytab_file_reader::version_1)
+            --count;
+        ok = ok && count >= 0 && read_data(entry.realm);
+        entry.components.resize(ok ? count : 0);
+        for(int16_t i = 0; ok && i < count; ++i)
+            ok = read_data(entry.components[i]);
+        entry.name_type = 0;
+        if(ok && _version != keytab_file_reader::version_1)
+            ok = read_int32(entry.name_type);
+        ok = ok && read_int32(entry.timestamp);
+        if(ok && _end - _pos >= 1)
+            entry.vno = _data[_pos++];
+        else
+            ok = false;
+        ok = ok && read_int16(enctype) && read_data(entry.key);
+        if(!ok)
+            return false;
+        entry.enctype = enctype;
+
+        // optional 32-bit kvno, which is only used when it is not zero-fill
+        if(_end - _pos >= 4 && read_int32(value) && value != 0)
+            entry.vno = (uint32_t)value;
+        return true;
+    }
+};
+
+void put_int16(std::string & buffer, int16_t value)
+{
+    uint16_t v = htons((uint16_t)value);
+    buffer.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+void put_int32(std::string & buffer, int32_t value)
+{
+    uint32_t v = htonl((uint32_t)value);
+    buffer.append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+void put_data(std::string & buffer, const data_view & value)
+{
+    put_int16(buffer, (int16_t)value.length);
+    buffer.append(value.data, value.length);
+}
+
+int write_all(int fd, const char * data, size_t size)
+{
+    while(size)
+    {
+        ssize_t written = ::write(fd, data, size);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return errno;
+        }
+        data += written;
+        size -= written;
+        statistics::count(statistics::bytes_written, written);
+    }
+    return 0;
+}
+
+} // namespace
+
+bool keytab_file_reader::next(keytab_file_entry & entry)
+{
+    if(!_data || _failed)
+        return false;
+
+    record_parser parser(_data, _pos, _size, _version);
+    int32_t size;
+    // skip all holes left behind by removed entries
+    do
+    {
+        entry.offset = parser.pos();
+        if(!parser.read_int32(size))
+        {
+            _pos = _size;
+            return false;
+        }
+        if(size < 0)
+        {
+            if(_size - parser.pos() < (size_t)-(int64_t)size)
+            {
+                _pos = _size;
+                return false;
+            }
+            parser = record_parser(_data, parser.pos() + -(int64_t)size, _size, _version);
+        }
+    }
+    while(size < 0);
+    // a zero size marks the end of the keytab
+    if(size == 0)
+    {
+        _pos = _size;
+        return false;
+    }
+
+    size_t start = parser.pos();
+    if(_size - start < (size_t)size)
+    {
+        _failed = true;
+        return false;
+    }
+    size_t end = start + size;
+    entry.size = end - entry.offset;
+
+    record_parser record(_data, start, end, _version);
+    if(!record.parse(entry))
+    {
+        _failed = true;
+        return false;
+    }
+    _pos = end;
+    statistics::count(statistics::entries_scanned);
+    return true;
+}
+
+keytab_file_writer::keytab_file_writer()
+    : _fd(-1), _exists(false), _created(false), _modified(false), _original_size(0), _loaded(0)
+{
+}
+
+keytab_file_writer::~keytab_file_writer()
+{
+    close();
+}
+
+int keytab_file_writer::open(const std::string & filename)
+{
+    statistics::timer t(statistics::phase_read);
+    close();
+
+    // replace the target of a symlink instead of the link itself
+    char * resolved = realpath(filename.c_str(), NULL);
+    _filename = resolved ? resolved : filename;
+    free(resolved);
+
+    struct stat st;
+    for(;;)
+    {
+        _fd = ::open(_filename.c_str(), O_RDWR | O_CLOEXEC);
+        if(_fd < 0 && errno == ENOENT)
+        {
+            // a new keytab is locked as well, so concurrent writers cannot
+            // both create it and lose the entries of the other one
+            _fd = ::open(_filename.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+            if(_fd < 0 && errno == EEXIST)
+                continue;
+            // if it cannot be created, commit() cannot write it either
+            if(_fd < 0)
+                return 0;
+            _created = true;
+        }
+        if(_fd < 0)
+            return errno;
+
+        // serialize with other writers (libkrb5 uses the same kind of lock)
+        struct flock lock;
+        memset(&lock, 0, sizeof(lock));
+        lock.l_type = F_WRLCK;
+        lock.l_whence = SEEK_SET;
+        while(fcntl(_fd, F_SETLKW, &lock) != 0)
+        {
+            if(errno != EINTR)
+            {
+                int err = errno;
+                close();
+                return err;
+            }
+        }
+
+        if(fstat(_fd, &st) != 0)
+        {
+            int err = errno;
+            close();
+            return err;
+        }
+        // another writer may have replaced the file while we waited for the
+        // lock; then the lock is held on the old file and must be taken again
+        struct stat current;
+        if(stat(_filename.c_str(), &current) == 0 && current.st_dev == st.st_dev && current.st_ino == st.st_ino)
+            break;
+        ::close(_fd);
+        _fd = -1;
+        _created = false;
+    }
+    _exists = !_created;
+    _original_size = st.st_size;
+    // an empty file is an empty keytab
+    if(st.st_size == 0)
+        return 0;
+
+    keytab_file_reader reader;
+    int err = reader.open(_fd);
+    if(err)
+    {
+        close();
+        return err;
+    }
+    statistics::count(statistics::cursor_restarts);
+    _buffer.reserve(reader.size());
+    keytab_file_entry entry;
+    while(reader.next(entry))
+        append(entry);
+    if(reader.failed())
+    {
+        close();
+        return EINVAL;
+    }
+    _loaded = _records.size();
+    return 0;
+}
+
+void keytab_file_writer::close()
+{
+    if(_fd >= 0)
+    {
+        // a keytab created only to lock it is removed while still locked;
+        // waiting writers notice that the file has been replaced
+        if(_created)
+            unlink(_filename.c_str());
+        ::close(_fd);
+    }
+    _fd = -1;
+    _exists = false;
+    _created = false;
+    _modified = false;
+    _original_size = 0;
+    _loaded = 0;
+    // do not leave any key material behind in the heap
+    if(!_buffer.empty())
+        explicit_bzero(&_buffer[0], _buffer.size());
+    _buffer.clear();
+    _records.clear();
+}
+
+void keytab_file_writer::append(const keytab_file_entry & entry)
+{
+    record rec;
+    rec.offset = _buffer.size();
+    rec.removed = false;
+
+    put_int32(_buffer, 0);
+    put_int16(_buffer, (int16_t)entry.components.size());
+    put_data(_buffer, entry.realm);
+    for(std::vector<data_view>::const_iterator it = entry.components.begin(); it != entry.components.end(); ++it)
+        put_data(_buffer, *it);
+    put_int32(_buffer, entry.name_type);
+    put_int32(_buffer, entry.timestamp);
+    _buffer.push_back((char)(entry.vno & 0xff));
+    put_int16(_buffer, (int16_t)entry.enctype);
+    put_data(_buffer, entry.key);
+    put_int32(_buffer, (int32_t)entry.vno);
+
+    rec.size = _buffer.size() - rec.offset;
+    uint32_t size = htonl((uint32_t)(rec.size - sizeof(uint32_t)));
+    memcpy(&_buffer[rec.offset], &size, sizeof(size));
+    _records.push_back(rec);
+}
+
+void keytab_file_writer::get(size_t index, keytab_file_entry & entry) const
+{
+    const record & rec = _records[index];
+    const unsigned char * data = reinterpret_cast<const unsigned char *>(_buffer.data());
+    record_parser parser(data, rec.offset + sizeof(uint32_t), rec.offset + rec.size, keytab_file_reader::version_2);
+    entry.offset = rec.offset;
+    entry.size = rec.size;
+    parser.parse(entry);
+}
+
+size_t keytab_file_writer::compacted_size() const
+{
+    size_t size = 2;
+    for(std::vector<record>::const_iterator it = _records.begin(); it != _records.end(); ++it)
+    {
+        if(!it->removed)
+            size += it->size;
+    }
+    return size;
+}
+
+void keytab_file_writer::add(const keytab_file_entry & entry)
+{
+    append(entry);
+    _modified = true;
+}
+
+void keytab_file_writer::remove(size_t index)
+{
+    if(!_records[index].removed)
+    {
+        _records[index].removed = true;
+        _modified = true;
+    }
+}
+
+int keytab_file_writer::commit()
+{
+    statistics::timer t(statistics::phase_write);
+    int err = 0;
+    if(_modified)
+    {
+        std::string tmpname = _filename + ".XXXXXX";
+        int fd = mkstemp(&tmpname[0]);
+        if(fd < 0)
+            return errno;
+
+        // keep the permissions and the owner of the existing keytab
+        struct stat st;
+        if(_exists && fstat(_fd, &st) == 0)
+        {
+            if(fchown(fd, st.st_uid, st.st_gid) != 0 && errno != EPERM)
+                err = errno;
+            if(!err && fchmod(fd, st.st_mode & 07777) != 0)
+                err = errno;
+        }
+
+        const char header[2] = { (char)(keytab_file_reader::version_2 >> 8), (char)(keytab_file_reader::version_2 & 0xff) };
+        if(!err)
+            err = write_all(fd, header, sizeof(header));
+        // write consecutive live entries with a single call
+        size_t i = 0;
+        while(!err && i < _records.size())
+        {
+            if(_records[i].removed)
+            {
+                ++i;
+                continue;
+            }
+            size_t offset = _records[i].offset;
+            size_t size = 0;
+            for(; i < _records.size() && !_records[i].removed; ++i)
+                size += _records[i].size;
+            err = write_all(fd, _buffer.data() + offset, size);
+        }
+        if(!err && fsync(fd) != 0)
+            err = errno;
+        if(::close(fd) != 0 && !err)
+            err = errno;
+        if(!err && rename(tmpname.c_str(), _filename.c_str()) != 0)
+            err = errno;
+        if(err)
+            unlink(tmpname.c_str());
+        else
+        {
+            _created = false;
+            // make the rename itself durable
+            std::string::size_type slash = _filename.rfind('/');
+            std::string dirname = (slash == std::string::npos) ? std::string(".") : _filename.substr(0, slash + 1);
+            int dirfd = ::open(dirname.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if(dirfd >= 0)
+            {
+                fsync(dirfd);
+                ::close(dirfd);
+            }
+            audit();
+        }
+    }
+    close();
+    return err;
+}
+
+void keytab_file_writer::audit() const
+{
+    audit_log * log = audit_log::installed();
+    if(!log)
+        return;
+    // a new keytab could not be resolved by open()
+    char * resolved = realpath(_filename.c_str(), NULL);
+    const std::string filename = resolved ? resolved : _filename;
+    free(resolved);
+    keytab_file_entry entry;
+    for(size_t i = 0; i < _records.size(); ++i)
+    {
+        // entries which have been added and removed again never existed
+        bool loaded = (i < _loaded);
+        if(_records[i].removed == loaded)
+        {
+            get(i, entry);
+            log->record(loaded ? audit_log::operation_remove : audit_log::operation_add, filename, entry);
+        }
+    }
+}
+
+    } // namespace krb5
+} // namespace arsoft
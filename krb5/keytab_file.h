@@ -0,0 +1,160 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace arsoft {
+    namespace krb5 {
+
+// Returns true if the given keytab name refers to a FILE (or WRFILE) keytab
+// and stores the path of the keytab file in path.
+bool get_file_keytab_path(const std::string & name, std::string & path);
+
+// 64-bit FNV-1a hash, used to detect changes of keytab files
+const uint64_t fnv1a_basis = 0xcbf29ce484222325ULL;
+uint64_t fnv1a(uint64_t hash, const void * data, size_t size);
+// computes the FNV-1a hash of the whole content of a file
+bool get_file_fingerprint(const std::string & path, uint64_t & fingerprint);
+
+// Non-owning reference to a sequence of bytes inside a keytab file.
+struct data_view
+{
+    const char * data;
+    size_t length;
+
+    data_view() : data(NULL), length(0) {}
+    std::string to_string() const { return std::string(data, length); }
+};
+
+// Lightweight view of a single keytab entry. All data views point directly
+// into the buffer of the keytab_file_reader and are only valid until the next
+// entry is read or the reader is closed.
+struct keytab_file_entry
+{
+    size_t offset;          // offset of the record (including its size field) in the file
+    size_t size;            // size of the record (including its size field)
+    data_view realm;
+    std::vector<data_view> components;
+    int32_t name_type;
+    int32_t timestamp;
+    uint32_t vno;
+    int32_t enctype;
+    data_view key;
+};
+
+// Native reader for the binary FILE: keytab format (version 0x501 and 0x502).
+// The keytab file is mapped into memory and the entries are returned as views
+// into the mapping, so reading an entry does not allocate any memory.
+class keytab_file_reader
+{
+    const unsigned char * _data;
+    size_t _size;
+    size_t _pos;
+    int _version;
+    bool _mapped;
+    bool _failed;
+
+    keytab_file_reader(const keytab_file_reader & rhs);
+    keytab_file_reader & operator=(const keytab_file_reader & rhs);
+
+public:
+    static const int version_1 = 0x501;
+    static const int version_2 = 0x502;
+
+    keytab_file_reader();
+    ~keytab_file_reader();
+
+    // maps the given keytab file into memory. Returns zero on success or an
+    // errno value. EINVAL is returned if the file is not a supported keytab.
+    int open(const std::string & filename);
+    // maps the keytab file of the given descriptor, which stays open and
+    // owned by the caller (e.g. to read exactly the file which has been locked)
+    int open(int fd);
+    // reads the entries from a keytab file which has already been loaded into
+    // memory (see keytab_file_loader); the data must outlive the reader.
+    // Returns zero or EINVAL if the data is not a supported keytab.
+    int open(const char * data, size_t size);
+    void close();
+
+    int version() const { return _version; }
+    size_t size() const { return _size; }
+    // returns true if the end of the keytab was not reached because of a
+    // malformed entry
+    bool failed() const { return _failed; }
+
+    // reads the next entry from the keytab and returns false at the end of
+    // the keytab or if the keytab is malformed.
+    bool next(keytab_file_entry & entry);
+    // continues reading at the given offset of a record (see
+    // keytab_file_entry::offset), e.g. taken from a keytab_index
+    void seek(size_t offset) { _pos = (offset < 2) ? 2 : offset; }
+};
+
+// Transactional writer for FILE: keytabs. The current content of the keytab is
+// loaded once, all mutations are applied in memory and commit() serializes the
+// resulting keytab (format 0x502) to a temporary file in the same directory,
+// which then atomically replaces the keytab. Readers therefore never see a
+// partially written keytab and removed entries do not leave holes behind.
+class keytab_file_writer
+{
+    struct record {
+        size_t offset;      // offset of the serialized record in _buffer
+        size_t size;
+        bool removed;
+    };
+    std::string _filename;
+    int _fd;
+    bool _exists;
+    bool _created;          // the (empty) file has been created to lock it
+    bool _modified;
+    size_t _original_size;
+    size_t _loaded;         // number of entries read from the keytab file
+    std::string _buffer;
+    std::vector<record> _records;
+
+    keytab_file_writer(const keytab_file_writer & rhs);
+    keytab_file_writer & operator=(const keytab_file_writer & rhs);
+
+    void append(const keytab_file_entry & entry);
+    void audit() const;
+
+public:
+    keytab_file_writer();
+    ~keytab_file_writer();
+
+    // locks the given keytab file and loads all of its entries. A missing
+    // file is treated as an empty keytab; it is created empty to hold the
+    // lock and removed again unless commit() writes it. Returns zero on
+    // success or an errno value.
+    int open(const std::string & filename);
+    // writes all entries to the keytab file if it has been modified and
+    // releases the lock. Returns zero on success or an errno value. The added
+    // and removed entries are recorded in the installed audit_log once the
+    // keytab has been written.
+    int commit();
+    // discards all modifications and releases the lock
+    void close();
+
+    bool modified() const { return _modified; }
+    // size of the keytab file when it has been opened
+    size_t original_size() const { return _original_size; }
+    // size of the keytab file as written by commit(): only the live entries,
+    // without any holes or unused space within records
+    size_t compacted_size() const;
+    // lets commit() rewrite the keytab even if no entry has been changed
+    void compact() { _modified = true; }
+
+    // number of entries including the removed ones
+    size_t size() const { return _records.size(); }
+    bool removed(size_t index) const { return _records[index].removed; }
+    // returns a view of the entry with the given index, which stays valid
+    // until the next entry has been added.
+    void get(size_t index, keytab_file_entry & entry) const;
+    void add(const keytab_file_entry & entry);
+    void remove(size_t index);
+};
+
+    } // namespace krb5
+} // namespace arsoft
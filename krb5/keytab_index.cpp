@@ -0,0 +1,332 @@
+#include "keytab_index.h"
+#include "keytab_file.h"
+#include "statistics.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace arsoft {
+    namespace krb5 {
+
+namespace {
+
+const char index_magic[8] = { 'A', 'K', 'T', 'I', 'D', 'X', '1', '\n' };
+
+// keytabs modified within this number of seconds are not indexed, because
+// further changes within the granularity of the mtime could not be detected
+const int64_t racy_window = 2;
+
+// every prefix_step-th record name is copied to the prefix table
+const size_t prefix_step = 64;
+
+// all numbers are stored in host byte order; the index is never shared
+// between hosts
+struct index_header {
+    char magic[8];
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime;
+    int64_t mtime_nsec;
+    int64_t built;
+    uint64_t fingerprint;
+    uint64_t count;
+    uint64_t prefix_count;
+    uint64_t names_size;
+};
+
+struct prefix_record {
+    uint32_t name_offset;
+    uint32_t name_length;
+};
+
+struct index_record {
+    uint64_t entry_offset;
+    uint32_t name_offset;
+    uint32_t name_length;
+};
+
+int write_all(int fd, const char * data, size_t size)
+{
+    while(size)
+    {
+        ssize_t written = ::write(fd, data, size);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return errno;
+        }
+        data += written;
+        size -= written;
+        statistics::count(statistics::bytes_written, written);
+    }
+    return 0;
+}
+
+struct entry_less {
+    bool operator()(const keytab_index::entry_list::value_type * a, const keytab_index::entry_list::value_type * b) const
+    {
+        int c = a->first.compare(b->first);
+        return c != 0 ? c < 0 : a->second < b->second;
+    }
+};
+
+} // namespace
+
+keytab_index::keytab_index()
+    : _data(NULL), _size(0), _state(), _count(0), _prefix_count(0), _prefixes(NULL), _records(NULL), _names(NULL), _names_size(0)
+{
+}
+
+keytab_index::~keytab_index()
+{
+    close();
+}
+
+bool keytab_index::get_state(const std::string & keytab_path, file_state & state)
+{
+    struct stat st;
+    if(::stat(keytab_path.c_str(), &st) != 0)
+        return false;
+    state.device = st.st_dev;
+    state.inode = st.st_ino;
+    state.size = st.st_size;
+    state.mtime = st.st_mtim.tv_sec;
+    state.mtime_nsec = st.st_mtim.tv_nsec;
+    return true;
+}
+
+bool keytab_index::open(const std::string & keytab_path)
+{
+    close();
+    file_state current;
+    if(!get_state(keytab_path, current))
+        return false;
+
+    int fd = ::open(filename(keytab_path).c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return false;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(index_header))
+    {
+        ::close(fd);
+        return false;
+    }
+    void * data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(data == MAP_FAILED)
+        return false;
+    _data = static_cast<const char *>(data);
+    _size = st.st_size;
+
+    index_header header;
+    memcpy(&header, _data, sizeof(header));
+    file_state recorded;
+    recorded.device = header.device;
+    recorded.inode = header.inode;
+    recorded.size = header.size;
+    recorded.mtime = header.mtime;
+    recorded.mtime_nsec = header.mtime_nsec;
+    const uint64_t expected_size = sizeof(header) + header.prefix_count * sizeof(prefix_record) +
+                                   header.count * sizeof(index_record) + header.names_size;
+    bool ok = memcmp(header.magic, index_magic, sizeof(index_magic)) == 0 &&
+              header.count <= _size && header.prefix_count <= _size && header.names_size <= _size &&
+              expected_size == _size && current == recorded;
+    uint64_t fingerprint;
+    if(ok && current.mtime >= header.built - racy_window)
+        ok = get_file_fingerprint(keytab_path, fingerprint) && fingerprint == header.fingerprint;
+    if(!ok)
+    {
+        close();
+        return false;
+    }
+    _state = recorded;
+    _count = header.count;
+    _prefix_count = header.prefix_count;
+    _prefixes = _data + sizeof(header);
+    _records = _prefixes + _prefix_count * sizeof(prefix_record);
+    _names = _records + _count * sizeof(index_record);
+    _names_size = header.names_size;
+    return true;
+}
+
+void keytab_index::close()
+{
+    if(_data)
+        munmap(const_cast<char *>(_data), _size);
+    _data = NULL;
+    _size = 0;
+    _count = 0;
+    _prefix_count = 0;
+    _prefixes = _records = _names = NULL;
+    _names_size = 0;
+}
+
+bool keytab_index::indexable(const file_state & state)
+{
+    return state.mtime < time(NULL) - racy_window;
+}
+
+int keytab_index::write(const std::string & keytab_path, const file_state & state, const entry_list & entries)
+{
+    statistics::timer t(statistics::phase_write);
+    index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, index_magic, sizeof(index_magic));
+    header.device = state.device;
+    header.inode = state.inode;
+    header.size = state.size;
+    header.mtime = state.mtime;
+    header.mtime_nsec = state.mtime_nsec;
+    header.built = time(NULL);
+    if(state.mtime >= header.built - racy_window)
+        return EAGAIN;
+    if(!get_file_fingerprint(keytab_path, header.fingerprint))
+        return errno;
+    file_state current;
+    if(!get_state(keytab_path, current))
+        return errno;
+    if(!(state == current))
+        return EAGAIN;
+
+    std::vector<const entry_list::value_type *> sorted;
+    sorted.reserve(entries.size());
+    for(entry_list::const_iterator it = entries.begin(); it != entries.end(); ++it)
+        sorted.push_back(&*it);
+    std::sort(sorted.begin(), sorted.end(), entry_less());
+
+    // every distinct name is stored once
+    std::string names;
+    std::vector<index_record> records(sorted.size());
+    for(size_t i = 0; i < sorted.size(); ++i)
+    {
+        index_record & rec = records[i];
+        rec.entry_offset = sorted[i]->second;
+        if(i > 0 && sorted[i]->first == sorted[i - 1]->first)
+            rec.name_offset = records[i - 1].name_offset;
+        else
+        {
+            if(names.size() + sorted[i]->first.size() > 0xffffffffUL)
+                return EFBIG;
+            rec.name_offset = names.size();
+            names += sorted[i]->first;
+        }
+        rec.name_length = sorted[i]->first.size();
+    }
+    std::vector<prefix_record> prefixes;
+    for(size_t i = 0; i < records.size(); i += prefix_step)
+    {
+        prefix_record prefix;
+        prefix.name_offset = records[i].name_offset;
+        prefix.name_length = records[i].name_length;
+        prefixes.push_back(prefix);
+    }
+    header.count = records.size();
+    header.prefix_count = prefixes.size();
+    header.names_size = names.size();
+
+    const std::string filename = keytab_index::filename(keytab_path);
+    std::string tmpname = filename + ".XXXXXX";
+    int fd = mkstemp(&tmpname[0]);
+    if(fd < 0)
+        return errno;
+    int err = write_all(fd, reinterpret_cast<const char *>(&header), sizeof(header));
+    if(!err && !prefixes.empty())
+        err = write_all(fd, reinterpret_cast<const char *>(&prefixes[0]), prefixes.size() * sizeof(prefix_record));
+    if(!err && !records.empty())
+        err = write_all(fd, reinterpret_cast<const char *>(&records[0]), records.size() * sizeof(index_record));
+    if(!err)
+        err = write_all(fd, names.data(), names.size());
+    // the index can be rebuilt at any time, so it is not synced
+    if(::close(fd) != 0 && !err)
+        err = errno;
+    if(!err && rename(tmpname.c_str(), filename.c_str()) != 0)
+        err = errno;
+    if(err)
+        unlink(tmpname.c_str());
+    return err;
+}
+
+int keytab_index::compare(size_t record, const std::string & name, bool prefix) const
+{
+    index_record rec;
+    memcpy(&rec, _records + record * sizeof(index_record), sizeof(rec));
+    return compare_name(rec.name_offset, rec.name_length, name, prefix);
+}
+
+int keytab_index::compare_block(size_t block, const std::string & name) const
+{
+    prefix_record rec;
+    memcpy(&rec, _prefixes + block * sizeof(prefix_record), sizeof(rec));
+    return compare_name(rec.name_offset, rec.name_length, name, false);
+}
+
+int keytab_index::compare_name(uint32_t name_offset, uint32_t name_length, const std::string & name, bool prefix) const
+{
+    if((uint64_t)name_offset + name_length > _names_size)
+        return 1;
+    size_t length = name_length;
+    // in a prefix comparison only the first characters of the record count
+    if(prefix && length > name.size())
+        length = name.size();
+    int c = memcmp(_names + name_offset, name.data(), std::min(length, name.size()));
+    if(c != 0)
+        return c;
+    return (length < name.size()) ? -1 : ((length > name.size()) ? 1 : 0);
+}
+
+uint64_t keytab_index::offset(size_t record) const
+{
+    index_record rec;
+    memcpy(&rec, _records + record * sizeof(index_record), sizeof(rec));
+    return rec.entry_offset;
+}
+
+size_t keytab_index::lower_bound(const std::string & name) const
+{
+    // find the block in the prefix table: the last block whose first name is
+    // less than the given name
+    size_t lo = 0;
+    size_t hi = _prefix_count;
+    while(lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if(compare_block(mid, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    size_t first = lo ? (lo - 1) * prefix_step : 0;
+    size_t last = std::min(_count, lo * prefix_step);
+    // and the first record not less than the name within that block
+    while(first < last)
+    {
+        size_t mid = (first + last) / 2;
+        if(compare(mid, name, false) < 0)
+            first = mid + 1;
+        else
+            last = mid;
+    }
+    return first;
+}
+
+void keytab_index::find(const std::string & name, std::vector<uint64_t> & offsets) const
+{
+    for(size_t i = lower_bound(name); i < _count && compare(i, name, false) == 0; ++i)
+        offsets.push_back(offset(i));
+}
+
+void keytab_index::find_prefix(const std::string & prefix, std::vector<uint64_t> & offsets) const
+{
+    for(size_t i = lower_bound(prefix); i < _count && compare(i, prefix, true) == 0; ++i)
+        offsets.push_back(offset(i));
+}
+
+    } // namespace krb5
+} // namespace arsoft
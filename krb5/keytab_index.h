@@ -0,0 +1,93 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace arsoft {
+    namespace krb5 {
+
+// Persistent index of a FILE: keytab, stored next to the keytab in
+// <keytab>.idx. It maps the principal names to the offsets of their entries
+// in the keytab file. The records are sorted by name, and a small prefix
+// table holds the name of every 64th record. A lookup of a name or prefix
+// searches the small prefix table first and then only the single block of 64
+// records which may contain the name.
+//
+// The index records device, inode, size and mtime of the keytab it has been
+// built for, together with a fingerprint of its content. It is ignored as
+// soon as any of them changes; the fingerprint is only compared if the keytab
+// had been modified shortly before the index has been built.
+class keytab_index
+{
+public:
+    typedef std::vector< std::pair<std::string, uint64_t> > entry_list;
+    struct file_state {
+        uint64_t device;
+        uint64_t inode;
+        uint64_t size;
+        int64_t mtime;
+        int64_t mtime_nsec;
+        bool operator==(const file_state & rhs) const
+        {
+            return device == rhs.device && inode == rhs.inode && size == rhs.size &&
+                   mtime == rhs.mtime && mtime_nsec == rhs.mtime_nsec;
+        }
+    };
+
+    keytab_index();
+    ~keytab_index();
+
+    static std::string filename(const std::string & keytab_path) { return keytab_path + ".idx"; }
+
+    // maps the index of the given keytab file; returns false if the index is
+    // missing, damaged or stale
+    bool open(const std::string & keytab_path);
+    void close();
+
+    // returns the current state of the keytab file, as passed to write()
+    static bool get_state(const std::string & keytab_path, file_state & state);
+    // returns false if the keytab has been modified too recently to be indexed
+    static bool indexable(const file_state & state);
+    // writes the index for the given (principal name, entry offset) pairs.
+    // The state of the keytab has to be taken before the entries have been
+    // read; the index is not written (EAGAIN) if the keytab has changed since
+    // then or if it has been modified too recently to detect further changes
+    // by its mtime. Returns zero on success or an errno value.
+    static int write(const std::string & keytab_path, const file_state & state, const entry_list & entries);
+
+    size_t size() const { return _count; }
+    // state of the keytab file the index has been built for
+    const file_state & state() const { return _state; }
+    // appends the offsets of all entries of the given principal
+    void find(const std::string & name, std::vector<uint64_t> & offsets) const;
+    // appends the offsets of all entries whose principal starts with prefix
+    void find_prefix(const std::string & prefix, std::vector<uint64_t> & offsets) const;
+
+private:
+    const char * _data;
+    size_t _size;
+    file_state _state;
+    size_t _count;
+    size_t _prefix_count;
+    const char * _prefixes;
+    const char * _records;
+    const char * _names;
+    size_t _names_size;
+
+    keytab_index(const keytab_index & rhs);
+    keytab_index & operator=(const keytab_index & rhs);
+
+    // position of the first record with a name not less than the given one
+    size_t lower_bound(const std::string & name) const;
+    int compare(size_t record, const std::string & name, bool prefix) const;
+    // compares the first name of the given block of the prefix table
+    int compare_block(size_t block, const std::string & name) const;
+    int compare_name(uint32_t name_offset, uint32_t name_length, const std::string & name, bool prefix) const;
+    uint64_t offset(size_t record) const;
+};
+
+    } // namespace krb5
+} // namespace arsoft
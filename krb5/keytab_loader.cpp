@@ -0,0 +1,320 @@
+#include "keytab_loader.h"
+#include "statistics.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+namespace arsoft {
+    namespace krb5 {
+
+keytab_file_loader::keytab_file_loader(unsigned queue_depth)
+    : _ring(NULL), _queue_depth(queue_depth ? queue_depth : 1)
+{
+#ifdef HAVE_LIBURING
+    // io_uring might be missing or disabled (e.g. by a seccomp filter)
+    struct io_uring * ring = new struct io_uring;
+    if(io_uring_queue_init(_queue_depth, ring, 0) == 0)
+        _ring = ring;
+    else
+        delete ring;
+#endif
+}
+
+keytab_file_loader::~keytab_file_loader()
+{
+#ifdef HAVE_LIBURING
+    if(_ring)
+    {
+        struct io_uring * ring = static_cast<struct io_uring *>(_ring);
+        io_uring_queue_exit(ring);
+        delete ring;
+    }
+#endif
+}
+
+int keytab_file_loader::read_file(const std::string & filename, std::string & contents)
+{
+    statistics::timer t(statistics::phase_read);
+    contents.clear();
+    int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return errno;
+    int err = 0;
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+        err = errno;
+    else
+    {
+        contents.resize(st.st_size);
+        size_t length = 0;
+        while(length < contents.size())
+        {
+            ssize_t n = pread(fd, &contents[length], contents.size() - length, length);
+            if(n < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                err = errno;
+                break;
+            }
+            if(n == 0)
+                break;
+            length += n;
+        }
+        // the file might have been truncated in the meantime
+        contents.resize(length);
+        statistics::count(statistics::bytes_read, length);
+    }
+    ::close(fd);
+    return err;
+}
+
+void keytab_file_loader::load(const std::vector<std::string> & filenames, completion_handler & handler)
+{
+    if(_ring && filenames.size() > 1)
+    {
+        load_batched(filenames, handler);
+        return;
+    }
+    std::string contents;
+    for(size_t i = 0; i < filenames.size(); ++i)
+    {
+        int err = read_file(filenames[i], contents);
+        handler(i, err, contents);
+    }
+}
+
+#ifdef HAVE_LIBURING
+
+namespace {
+
+// most keytabs are read with a single read of this size
+const size_t initial_read_size = 8192;
+
+struct load_slot {
+    enum state_type {
+        idle,
+        opening,
+        reading
+    };
+    state_type state;
+    size_t index;
+    int fd;
+    size_t length;          // bytes read so far
+    std::string contents;
+    load_slot() : state(idle), index(0), fd(-1), length(0) {}
+};
+
+// cancels the requests of all busy slots and waits until each of them has
+// completed; returns false if the ring failed before all were completed
+bool cancel_batch(struct io_uring * ring, std::vector<load_slot> & slots)
+{
+    size_t pending = 0;
+    for(std::vector<load_slot>::iterator it = slots.begin(); it != slots.end(); ++it)
+    {
+        if(it->state == load_slot::idle)
+            continue;
+        ++pending;
+        struct io_uring_sqe * sqe = io_uring_get_sqe(ring);
+        if(!sqe)
+        {
+            io_uring_submit(ring);
+            sqe = io_uring_get_sqe(ring);
+        }
+        // a request which cannot be cancelled is simply waited for
+        if(sqe)
+        {
+            io_uring_prep_cancel(sqe, &*it, 0);
+            io_uring_sqe_set_data(sqe, NULL);
+        }
+    }
+    io_uring_submit(ring);
+    while(pending)
+    {
+        struct io_uring_cqe * cqe;
+        int ret = io_uring_wait_cqe(ring, &cqe);
+        if(ret == -EINTR)
+            continue;
+        if(ret < 0)
+            return false;
+        load_slot * slot = static_cast<load_slot *>(io_uring_cqe_get_data(cqe));
+        const int res = cqe->res;
+        io_uring_cqe_seen(ring, cqe);
+        // completions of the cancel requests carry no slot
+        if(!slot || slot->state == load_slot::idle)
+            continue;
+        // an open which has completed anyway returns a new fd
+        if(slot->state == load_slot::opening && res >= 0)
+            ::close(res);
+        if(slot->fd >= 0)
+            ::close(slot->fd);
+        slot->fd = -1;
+        slot->state = load_slot::idle;
+        --pending;
+    }
+    return true;
+}
+
+} // namespace
+
+void keytab_file_loader::load_batched(const std::vector<std::string> & filenames, completion_handler & handler)
+{
+    struct io_uring * ring = static_cast<struct io_uring *>(_ring);
+    // every slot has at most one request in flight, so the submission queue
+    // never overflows
+    std::vector<load_slot> slots(std::min<size_t>(_queue_depth, filenames.size()));
+    std::vector<load_slot*> free_slots;
+    for(std::vector<load_slot>::iterator it = slots.begin(); it != slots.end(); ++it)
+        free_slots.push_back(&*it);
+    size_t next = 0;
+    size_t active = 0;
+    std::vector<size_t> fallback;
+
+    while(next < filenames.size() || active)
+    {
+        // queue the opens of further files while slots are available
+        while(next < filenames.size() && !free_slots.empty())
+        {
+            load_slot * slot = free_slots.back();
+            free_slots.pop_back();
+            struct io_uring_sqe * sqe = io_uring_get_sqe(ring);
+            slot->state = load_slot::opening;
+            slot->index = next++;
+            slot->fd = -1;
+            slot->length = 0;
+            io_uring_prep_openat(sqe, AT_FDCWD, filenames[slot->index].c_str(), O_RDONLY | O_CLOEXEC, 0);
+            io_uring_sqe_set_data(sqe, slot);
+            ++active;
+        }
+
+        int ret;
+        {
+            statistics::timer t(statistics::phase_read);
+            ret = io_uring_submit_and_wait(ring, 1);
+        }
+        if(ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY)
+        {
+            // should not happen; the files in flight are read again below
+            for(std::vector<load_slot>::iterator it = slots.begin(); it != slots.end(); ++it)
+            {
+                if(it->state != load_slot::idle)
+                    fallback.push_back(it->index);
+            }
+            for(; next < filenames.size(); ++next)
+                fallback.push_back(next);
+            // the requests in flight still refer to the slots, so they are
+            // cancelled and waited for before the slots and fds are released
+            if(cancel_batch(ring, slots))
+            {
+                io_uring_queue_exit(ring);
+                delete ring;
+            }
+            else
+            {
+                // a late completion must never write into freed memory
+                (new std::vector<load_slot>())->swap(slots);
+            }
+            _ring = NULL;
+            break;
+        }
+
+        struct io_uring_cqe * cqe;
+        while(io_uring_peek_cqe(ring, &cqe) == 0)
+        {
+            load_slot * slot = static_cast<load_slot *>(io_uring_cqe_get_data(cqe));
+            const int res = cqe->res;
+            io_uring_cqe_seen(ring, cqe);
+
+            int err = 0;
+            bool done = false;
+            if(slot->state == load_slot::opening)
+            {
+                if(res == -EINVAL || res == -EOPNOTSUPP)
+                {
+                    // the kernel does not support this opcode
+                    err = read_file(filenames[slot->index], slot->contents);
+                    done = true;
+                }
+                else if(res < 0)
+                {
+                    err = -res;
+                    slot->contents.clear();
+                    done = true;
+                }
+                else
+                {
+                    slot->fd = res;
+                    slot->state = load_slot::reading;
+                    slot->contents.resize(initial_read_size);
+                }
+            }
+            else if(res < 0)
+            {
+                err = -res;
+                done = true;
+            }
+            else
+            {
+                const size_t requested = slot->contents.size() - slot->length;
+                slot->length += res;
+                statistics::count(statistics::bytes_read, res);
+                // a short read of a regular file means the end of the file
+                if((size_t)res < requested)
+                {
+                    slot->contents.resize(slot->length);
+                    done = true;
+                }
+                else
+                    slot->contents.resize(slot->contents.size() * 2);
+            }
+
+            if(done)
+            {
+                if(slot->fd >= 0)
+                    ::close(slot->fd);
+                slot->fd = -1;
+                slot->state = load_slot::idle;
+                --active;
+                handler(slot->index, err, slot->contents);
+                free_slots.push_back(slot);
+            }
+            else
+            {
+                struct io_uring_sqe * sqe = io_uring_get_sqe(ring);
+                io_uring_prep_read(sqe, slot->fd, &slot->contents[slot->length],
+                                   slot->contents.size() - slot->length, slot->length);
+                io_uring_sqe_set_data(sqe, slot);
+            }
+        }
+    }
+
+    std::string contents;
+    for(std::vector<size_t>::const_iterator it = fallback.begin(); it != fallback.end(); ++it)
+    {
+        int err = read_file(filenames[*it], contents);
+        handler(*it, err, contents);
+    }
+}
+
+#else // HAVE_LIBURING
+
+void keytab_file_loader::load_batched(const std::vector<std::string> & filenames, completion_handler & handler)
+{
+    // without liburing the ring is never set up
+    std::string contents;
+    for(size_t i = 0; i < filenames.size(); ++i)
+    {
+        int err = read_file(filenames[i], contents);
+        handler(i, err, contents);
+    }
+}
+
+#endif // HAVE_LIBURING
+
+    } // namespace krb5
+} // namespace arsoft
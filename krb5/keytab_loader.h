@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+
+namespace arsoft {
+    namespace krb5 {
+
+// Reads many (small) keytab files into memory at once. If akt has been built
+// with liburing and the kernel supports io_uring, the opens and reads of up to
+// queue_depth files are submitted together and every file is passed to the
+// handler as soon as it has been read completely, so the latency of the
+// individual opens and reads (e.g. on NFS) overlaps. Otherwise, or if io_uring
+// cannot be set up at runtime, the files are read one after the other with
+// pread().
+class keytab_file_loader
+{
+public:
+    struct completion_handler {
+        // called once for every file in the order of completion; error is
+        // zero or an errno value. The handler may keep the contents by
+        // swapping them.
+        virtual void operator()(size_t index, int error, std::string & contents) = 0;
+    };
+
+    explicit keytab_file_loader(unsigned queue_depth=32);
+    ~keytab_file_loader();
+
+    void load(const std::vector<std::string> & filenames, completion_handler & handler);
+    // returns true if the files are read with io_uring
+    bool batched() const { return _ring != NULL; }
+
+    // reads a single file with pread()
+    static int read_file(const std::string & filename, std::string & contents);
+
+private:
+    void * _ring;               // struct io_uring, if available
+    unsigned _queue_depth;
+
+    keytab_file_loader(const keytab_file_loader & rhs);
+    keytab_file_loader & operator=(const keytab_file_loader & rhs);
+
+    void load_batched(const std::vector<std::string> & filenames, completion_handler & handler);
+};
+
+    } // namespace krb5
+} // namespace arsoft
@@ -0,0 +1,335 @@
+#include "keytab_watch.h"
+#include "keytab_file.h"
+#include "krb5_wrapper.h"
+#include "probes.h"
+#include <iostream>
+#include <algorithm>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+
+namespace arsoft {
+    namespace krb5 {
+
+namespace {
+
+const uint32_t watch_events = IN_CLOSE_WRITE | IN_MOVED_TO;
+
+// after this multiple of the delay the destinations are updated even if the
+// sources are still changing
+const unsigned max_delay_factor = 10;
+
+uint64_t monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// splits the path of the keytab file into the directory to watch and the
+// name of the file. Symbolic links are resolved, because the link target is
+// the file which gets replaced.
+bool split_keytab_path(const std::string & name, std::string & directory, std::string & filename)
+{
+    std::string path;
+    if(!get_file_keytab_path(name, path) || path.empty())
+        return false;
+    char resolved[PATH_MAX];
+    if(realpath(path.c_str(), resolved))
+        path = resolved;
+    else if(path[0] != '/')
+    {
+        char cwd[PATH_MAX];
+        if(!getcwd(cwd, sizeof(cwd)))
+            return false;
+        path = std::string(cwd) + '/' + path;
+    }
+    std::string::size_type pos = path.rfind('/');
+    directory = (pos == 0) ? std::string("/") : path.substr(0, pos);
+    filename = path.substr(pos + 1);
+    return !filename.empty();
+}
+
+} // namespace
+
+keytab_watch::keytab_watch(const context & ctx, bool expunge)
+    : _ctx(ctx), _expunge(expunge), _verbose(false), _delay(200), _filter(NULL), _inotify_fd(-1), _signal_fd(-1)
+{
+}
+
+keytab_watch::~keytab_watch()
+{
+    cleanup();
+}
+
+void keytab_watch::add(const std::string & source, const std::string & dest)
+{
+    for(source_list::iterator it = _sources.begin(); it != _sources.end(); ++it)
+    {
+        if(it->name == source)
+        {
+            it->destinations.push_back(dest);
+            return;
+        }
+    }
+    source_info info;
+    info.name = source;
+    info.destinations.push_back(dest);
+    info.changed = false;
+    _sources.push_back(info);
+}
+
+int keytab_watch::setup()
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    if(sigprocmask(SIG_BLOCK, &mask, NULL) != 0)
+        return errno;
+    _signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if(_signal_fd < 0)
+        return errno;
+
+    _inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(_inotify_fd < 0)
+        return errno;
+    for(source_list::iterator it = _sources.begin(); it != _sources.end(); ++it)
+    {
+        if(!split_keytab_path(it->name, it->directory, it->filename))
+        {
+            std::cerr << "Cannot watch keytab " << it->name << ": only FILE keytabs are supported" << std::endl;
+            return EINVAL;
+        }
+        // inotify returns the same watch descriptor for the same directory
+        int wd = inotify_add_watch(_inotify_fd, it->directory.c_str(), watch_events);
+        if(wd < 0)
+        {
+            int err = errno;
+            std::cerr << "Cannot watch directory " << it->directory << ": " << strerror(err) << std::endl;
+            return err;
+        }
+        _directories[wd] = it->directory;
+    }
+    return 0;
+}
+
+void keytab_watch::cleanup()
+{
+    if(_inotify_fd >= 0)
+    {
+        ::close(_inotify_fd);
+        _inotify_fd = -1;
+    }
+    _directories.clear();
+    if(_signal_fd >= 0)
+    {
+        ::close(_signal_fd);
+        _signal_fd = -1;
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+        sigaddset(&mask, SIGHUP);
+        sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    }
+}
+
+bool keytab_watch::read_events()
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    for(;;)
+    {
+        ssize_t len = ::read(_inotify_fd, buf, sizeof(buf));
+        if(len < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return errno == EAGAIN;
+        }
+        for(char * p = buf; p < buf + len; )
+        {
+            const struct inotify_event * event = reinterpret_cast<const struct inotify_event *>(p);
+            p += sizeof(struct inotify_event) + event->len;
+
+            if(event->mask & IN_Q_OVERFLOW)
+            {
+                // events have been lost, so every source might have changed
+                for(source_list::iterator it = _sources.begin(); it != _sources.end(); ++it)
+                    it->changed = true;
+                continue;
+            }
+            std::map<int, std::string>::const_iterator dir = _directories.find(event->wd);
+            if(dir == _directories.end())
+                continue;
+            if(event->mask & IN_IGNORED)
+            {
+                std::cerr << "Directory " << dir->second << " is no longer watched" << std::endl;
+                return false;
+            }
+            if(!event->len)
+                continue;
+            for(source_list::iterator it = _sources.begin(); it != _sources.end(); ++it)
+            {
+                if(it->directory == dir->second && it->filename == event->name)
+                    it->changed = true;
+            }
+        }
+    }
+}
+
+bool keytab_watch::sync(source_info & source)
+{
+    bool ret = true;
+    AKT_PROBE2(watch__sync__start, source.name.c_str(), source.destinations.size());
+    // read the source only once for all destinations
+    keytab_snapshot snapshot;
+    try
+    {
+        keytab sourceKeyTab(_ctx, source.name);
+        sourceKeyTab.set_filter(_filter);
+        sourceKeyTab.snapshot(snapshot);
+    }
+    catch(error & e)
+    {
+        std::cerr << "Kerberos error " << e.code() << ": " << e.what() << std::endl;
+        AKT_PROBE2(watch__sync__done, source.name.c_str(), false);
+        return false;
+    }
+    for(std::vector<std::string>::const_iterator it = source.destinations.begin(); it != source.destinations.end(); ++it)
+    {
+        if(_verbose)
+            std::cout << "update " << source.name << " -> " << *it << std::endl;
+        try
+        {
+            keytab destKeyTab(_ctx, *it);
+            destKeyTab.set_filter(_filter);
+            bool ok = destKeyTab.update(snapshot);
+            if(ok && _expunge)
+                ok = destKeyTab.expunge();
+            if(!ok)
+            {
+                std::cerr << "Failed to update " << *it << " from " << source.name << std::endl;
+                ret = false;
+            }
+        }
+        catch(error & e)
+        {
+            std::cerr << "Kerberos error " << e.code() << ": " << e.what() << std::endl;
+            ret = false;
+        }
+    }
+    AKT_PROBE2(watch__sync__done, source.name.c_str(), ret);
+    return ret;
+}
+
+void keytab_watch::sync_changed()
+{
+    for(source_list::iterator it = _sources.begin(); it != _sources.end(); ++it)
+    {
+        if(!it->changed)
+            continue;
+        it->changed = false;
+        sync(*it);
+    }
+}
+
+int keytab_watch::run()
+{
+    int err = setup();
+    if(err)
+    {
+        cleanup();
+        return err;
+    }
+
+    for(source_list::iterator it = _sources.begin(); it != _sources.end(); ++it)
+        it->changed = true;
+    sync_changed();
+
+    uint64_t first_event = 0;
+    bool pending = false;
+    bool running = true;
+    while(running)
+    {
+        int timeout = -1;
+        if(pending)
+        {
+            uint64_t now = monotonic_ms();
+            uint64_t deadline = first_event + (uint64_t)_delay * max_delay_factor;
+            if(now >= deadline)
+            {
+                sync_changed();
+                pending = false;
+                continue;
+            }
+            timeout = (int)std::min<uint64_t>(_delay, deadline - now);
+        }
+
+        struct pollfd fds[2];
+        fds[0].fd = _signal_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = _inotify_fd;
+        fds[1].events = POLLIN;
+        int ready = poll(fds, 2, timeout);
+        if(ready < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            err = errno;
+            break;
+        }
+        if(ready == 0)
+        {
+            // no further events within the delay
+            sync_changed();
+            pending = false;
+            continue;
+        }
+        if(fds[0].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            if(::read(_signal_fd, &info, sizeof(info)) == sizeof(info))
+            {
+                if(info.ssi_signo == SIGHUP)
+                {
+                    for(source_list::iterator it = _sources.begin(); it != _sources.end(); ++it)
+                        it->changed = true;
+                    sync_changed();
+                    pending = false;
+                }
+                else
+                    running = false;
+            }
+        }
+        if(running && (fds[1].revents & POLLIN))
+        {
+            if(!read_events())
+            {
+                err = EIO;
+                break;
+            }
+            bool changed = false;
+            for(source_list::const_iterator it = _sources.begin(); !changed && it != _sources.end(); ++it)
+                changed = it->changed;
+            if(changed && !pending)
+            {
+                pending = true;
+                first_event = monotonic_ms();
+            }
+        }
+    }
+    cleanup();
+    return err;
+}
+
+    } // namespace krb5
+} // namespace arsoft
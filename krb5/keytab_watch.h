@@ -0,0 +1,72 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+
+namespace arsoft {
+    namespace krb5 {
+
+class context;
+class entry_filter;
+
+// Keeps destination keytabs in sync with their source keytabs. The directories
+// of the source keytabs are watched with inotify (keytabs are usually replaced
+// by a rename, so watching the file itself is not sufficient), bursts of
+// events are coalesced and only the destinations of the changed sources are
+// updated. All keytabs are accessed with the same long-lived context.
+// Destinations are always updated: a copy would add all entries of the
+// source again on every change.
+class keytab_watch
+{
+public:
+    keytab_watch(const context & ctx, bool expunge=false);
+    ~keytab_watch();
+
+    // adds a destination which is kept in sync with the given source
+    void add(const std::string & source, const std::string & dest);
+    // time without further events before the destinations are updated
+    void set_delay(unsigned milliseconds) { _delay = milliseconds; }
+    void set_verbose(bool verbose) { _verbose = verbose; }
+    // only entries matching the filter are taken from the sources (and
+    // removed by the expunge)
+    void set_filter(const entry_filter * filter) { _filter = filter; }
+
+    // synchronizes all destinations once and then waits for changes until
+    // SIGINT or SIGTERM is received; SIGHUP synchronizes all destinations
+    // again. Returns zero on a regular shutdown, otherwise an errno value.
+    int run();
+
+private:
+    struct source_info {
+        std::string name;       // keytab name as given by the user
+        std::string directory;
+        std::string filename;
+        std::vector<std::string> destinations;
+        bool changed;
+    };
+    typedef std::vector<source_info> source_list;
+
+    const context & _ctx;
+    bool _expunge;
+    bool _verbose;
+    unsigned _delay;
+    const entry_filter * _filter;
+    source_list _sources;
+    int _inotify_fd;
+    int _signal_fd;
+    std::map<int, std::string> _directories;
+
+    keytab_watch(const keytab_watch & rhs);
+    keytab_watch & operator=(const keytab_watch & rhs);
+
+    int setup();
+    void cleanup();
+    // reads all pending inotify events; returns false on errors
+    bool read_events();
+    bool sync(source_info & source);
+    void sync_changed();
+};
+
+    } // namespace krb5
+} // namespace arsoft
@@ -1,7 +1,20 @@
 #include "krb5_wrapper.h"
+#include "keytab_file.h"
+#include "entry_filter.h"
+#include "keytab_index.h"
+#include "statistics.h"
+#include "audit_log.h"
+#include "probes.h"
 #include <krb5.h>
 #include <string.h>
+#include <stdlib.h>
+#include <errno.h>
 #include <vector>
+#include <algorithm>
+#include <memory>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+#include <fnmatch.h>
 
 #include <iostream>
 using namespace std;
@@ -9,19 +22,436 @@ using namespace std;
 namespace arsoft {
     namespace krb5 {
 
+namespace {
+
+// Builds a binary key from the realm and the components of the given principal.
+// Two principals get the same key exactly when krb5_principal_compare() considers
+// them equal, but no krb5_unparse_name() (and no allocation inside libkrb5) is needed.
+void append_principal_key(std::string & key, const krb5_principal_data * principal)
+{
+    uint32_t length = principal->realm.length;
+    key.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    key.append(principal->realm.data, principal->realm.length);
+    for(krb5_int32 i = 0; i < principal->length; ++i)
+    {
+        const krb5_data & component = principal->data[i];
+        length = component.length;
+        key.append(reinterpret_cast<const char*>(&length), sizeof(length));
+        key.append(component.data, component.length);
+    }
+}
+
+// In-memory index of a keytab keyed by (principal, enctype) which holds the
+// highest kvno and the newest timestamp seen for this kvno. It implements the
+// same rules as keytab::updateEntry() but without re-scanning the keytab for
+// every single entry.
+class version_index
+{
+    struct version {
+        krb5_kvno vno;
+        krb5_timestamp timestamp;
+    };
+    typedef boost::unordered_map<std::string, version> map_type;
+    map_type _map;
+    std::string _key;
+
+    const std::string & make_key(const krb5_keytab_entry & entry)
+    {
+        _key.clear();
+        append_principal_key(_key, entry.principal);
+        _key.append(reinterpret_cast<const char*>(&entry.key.enctype), sizeof(entry.key.enctype));
+        return _key;
+    }
+
+public:
+    // records the given entry in the index
+    void insert(const krb5_keytab_entry & entry)
+    {
+        std::pair<map_type::iterator, bool> r = _map.insert(map_type::value_type(make_key(entry), version()));
+        version & v = r.first->second;
+        if(r.second || entry.vno > v.vno)
+        {
+            v.vno = entry.vno;
+            v.timestamp = entry.timestamp;
+        }
+        else if(entry.vno == v.vno && entry.timestamp > v.timestamp)
+            v.timestamp = entry.timestamp;
+    }
+
+    // returns true if the given entry is newer than all indexed entries with the
+    // same principal and enctype and records it in the index.
+    bool accept(const krb5_keytab_entry & entry)
+    {
+        std::pair<map_type::iterator, bool> r = _map.insert(map_type::value_type(make_key(entry), version()));
+        version & v = r.first->second;
+        if(!r.second)
+        {
+            if(v.vno > entry.vno)
+            {
+                // newer key entry with higher kvno is already in the keytab
+                return false;
+            }
+            else if(v.vno == entry.vno && v.timestamp >= entry.timestamp)
+            {
+                // same kvno but a new (or same) timestamp already in keytab
+                return false;
+            }
+        }
+        v.vno = entry.vno;
+        v.timestamp = entry.timestamp;
+        return true;
+    }
+};
+
+// Groups the entries of a keytab by (magic, principal, enctype) and remembers
+// the kvno of every entry, so obsolete entries can be determined after a
+// single pass over the keytab. Only one copy of the principal is kept per group.
+class expunge_table
+{
+    struct group {
+        krb5_principal principal;
+        krb5_magic magic;
+        krb5_enctype enctype;
+        krb5_kvno max_vno;
+    };
+    struct record {
+        size_t group;
+        krb5_kvno vno;
+        bool selected;      // only selected entries may be removed
+    };
+    typedef boost::unordered_map<std::string, size_t> map_type;
+    krb5_context _ctx;
+    map_type _map;
+    std::vector<group> _groups;
+    std::vector<record> _records;
+    std::string _key;
+
+public:
+    expunge_table(krb5_context ctx)
+        : _ctx(ctx) {}
+    ~expunge_table()
+    {
+        for(std::vector<group>::iterator it = _groups.begin(); it != _groups.end(); ++it)
+            krb5_free_principal(_ctx, it->principal);
+    }
+
+    krb5_error_code insert(const krb5_keytab_entry & entry, bool selected=true)
+    {
+        _key.clear();
+        append_principal_key(_key, entry.principal);
+        _key.append(reinterpret_cast<const char*>(&entry.key.enctype), sizeof(entry.key.enctype));
+        _key.append(reinterpret_cast<const char*>(&entry.magic), sizeof(entry.magic));
+
+        std::pair<map_type::iterator, bool> r = _map.insert(map_type::value_type(_key, _groups.size()));
+        if(r.second)
+        {
+            group g;
+            krb5_error_code code = krb5_copy_principal(_ctx, entry.principal, &g.principal);
+            if(code)
+            {
+                _map.erase(r.first);
+                return code;
+            }
+            g.magic = entry.magic;
+            g.enctype = entry.key.enctype;
+            g.max_vno = entry.vno;
+            _groups.push_back(g);
+        }
+        else if(entry.vno > _groups[r.first->second].max_vno)
+            _groups[r.first->second].max_vno = entry.vno;
+
+        record rec;
+        rec.group = r.first->second;
+        rec.vno = entry.vno;
+        rec.selected = selected;
+        _records.push_back(rec);
+        return 0;
+    }
+
+    // returns all selected entries which have a newer kvno in their group. The returned
+    // entries only carry the fields required by krb5_kt_remove_entry() and
+    // reference principals owned by this table.
+    void obsolete_entries(std::vector<krb5_keytab_entry> & entries) const
+    {
+        for(std::vector<record>::const_iterator it = _records.begin(); it != _records.end(); ++it)
+        {
+            const group & g = _groups[it->group];
+            if(it->selected && it->vno < g.max_vno)
+            {
+                krb5_keytab_entry entry;
+                memset(&entry, 0, sizeof(entry));
+                entry.magic = g.magic;
+                entry.principal = g.principal;
+                entry.vno = it->vno;
+                entry.key.enctype = g.enctype;
+                entries.push_back(entry);
+            }
+        }
+    }
+};
+
+// Provides a krb5_keytab_entry for an entry read by the keytab_file_reader.
+// The principal and the key reference the mapped keytab file and the component
+// buffer is reused for all entries, so no memory is allocated per entry.
+class entry_shell
+{
+    krb5_principal_data _principal;
+    std::vector<krb5_data> _components;
+public:
+    krb5_keytab_entry entry;
+
+    entry_shell()
+    {
+        memset(&_principal, 0, sizeof(_principal));
+        memset(&entry, 0, sizeof(entry));
+        _principal.magic = KV5M_PRINCIPAL;
+        _principal.realm.magic = KV5M_DATA;
+        entry.magic = KV5M_KEYTAB_ENTRY;
+        entry.principal = &_principal;
+        entry.key.magic = KV5M_KEYBLOCK;
+    }
+
+    void assign(const keytab_file_entry & view)
+    {
+        _principal.realm.length = view.realm.length;
+        _principal.realm.data = const_cast<char*>(view.realm.data);
+        _components.resize(view.components.size());
+        for(size_t i = 0; i < view.components.size(); ++i)
+        {
+            krb5_data & component = _components[i];
+            component.magic = KV5M_DATA;
+            component.length = view.components[i].length;
+            component.data = const_cast<char*>(view.components[i].data);
+        }
+        _principal.data = _components.empty() ? NULL : &_components[0];
+        _principal.length = _components.size();
+        _principal.type = view.name_type;
+        entry.timestamp = view.timestamp;
+        entry.vno = view.vno;
+        entry.key.enctype = view.enctype;
+        entry.key.length = view.key.length;
+        entry.key.contents = reinterpret_cast<krb5_octet*>(const_cast<char*>(view.key.data));
+    }
+};
+
+// Fills a view with the data of the given entry, e.g. to pass it to the
+// keytab_file_writer.
+void assign_view(keytab_file_entry & view, const krb5_keytab_entry & entry)
+{
+    view.offset = 0;
+    view.size = 0;
+    view.realm.data = entry.principal->realm.data;
+    view.realm.length = entry.principal->realm.length;
+    view.components.resize(entry.principal->length);
+    for(krb5_int32 i = 0; i < entry.principal->length; ++i)
+    {
+        view.components[i].data = entry.principal->data[i].data;
+        view.components[i].length = entry.principal->data[i].length;
+    }
+    view.name_type = entry.principal->type;
+    view.timestamp = entry.timestamp;
+    view.vno = entry.vno;
+    view.enctype = entry.key.enctype;
+    view.key.data = reinterpret_cast<const char*>(entry.key.contents);
+    view.key.length = entry.key.length;
+}
+
+// Records a modification done through libkrb5 in the installed audit log.
+// Modifications of FILE: keytabs are recorded by the keytab_file_writer.
+void audit_entry(audit_log::operation op, const std::string & keytab, const krb5_keytab_entry & entry)
+{
+    audit_log * log = audit_log::installed();
+    if(log)
+    {
+        keytab_file_entry view;
+        assign_view(view, entry);
+        log->record(op, keytab, view);
+    }
+}
+
+// Set of principals and glob patterns for matching keytab entries. Exact
+// principals are parsed once and looked up by their binary key, so the name of
+// an entry only needs to be unparsed when glob patterns are given.
+class principal_matcher
+{
+    krb5_context _ctx;
+    boost::unordered_set<std::string> _principals;
+    std::vector<std::string> _patterns;
+    std::string _key;
+
+public:
+    principal_matcher(krb5_context ctx)
+        : _ctx(ctx) {}
+
+    krb5_error_code add(const std::string & name)
+    {
+        krb5_error_code code = 0;
+        if(name.find_first_of("*?[") != std::string::npos)
+        {
+            std::string pattern = name;
+            if(name.find('@') == std::string::npos)
+            {
+                char * realm = NULL;
+                if(krb5_get_default_realm(_ctx, &realm) == 0)
+                {
+                    pattern += '@';
+                    pattern += realm;
+                    krb5_free_default_realm(_ctx, realm);
+                }
+                else
+                    pattern += "@*";
+            }
+            _patterns.push_back(pattern);
+        }
+        else
+        {
+            krb5_principal principal;
+            statistics::count(statistics::krb5_calls);
+            code = krb5_parse_name(_ctx, name.c_str(), &principal);
+            if(code == 0)
+            {
+                _key.clear();
+                append_principal_key(_key, principal);
+                _principals.insert(_key);
+                krb5_free_principal(_ctx, principal);
+            }
+        }
+        return code;
+    }
+
+    bool match(krb5_const_principal principal)
+    {
+        _key.clear();
+        append_principal_key(_key, principal);
+        if(_principals.find(_key) != _principals.end())
+            return true;
+        if(_patterns.empty())
+            return false;
+        bool ret = false;
+        char * name = NULL;
+        krb5_error_code code;
+        {
+            statistics::timer t(statistics::phase_unparse);
+            statistics::count(statistics::krb5_calls);
+            code = krb5_unparse_name(_ctx, principal, &name);
+        }
+        if(code == 0)
+        {
+            for(std::vector<std::string>::const_iterator it = _patterns.begin(); !ret && it != _patterns.end(); ++it)
+                ret = (fnmatch(it->c_str(), name, 0) == 0);
+            krb5_free_unparsed_name(_ctx, name);
+        }
+        return ret;
+    }
+};
+
+// Copies the entry including its principal and key into the given arena.
+krb5_keytab_entry * copy_entry(arena & a, const krb5_keytab_entry & entry)
+{
+    const krb5_principal_data * src = entry.principal;
+    krb5_principal_data * principal = static_cast<krb5_principal_data*>(a.copy(src, sizeof(krb5_principal_data), alignof(krb5_principal_data)));
+    principal->realm.data = static_cast<char*>(a.copy(src->realm.data, src->realm.length));
+    principal->data = static_cast<krb5_data*>(a.copy(src->data, sizeof(krb5_data) * src->length, alignof(krb5_data)));
+    for(krb5_int32 i = 0; i < src->length; ++i)
+        principal->data[i].data = static_cast<char*>(a.copy(src->data[i].data, src->data[i].length));
+
+    krb5_keytab_entry * ret = static_cast<krb5_keytab_entry*>(a.copy(&entry, sizeof(krb5_keytab_entry), alignof(krb5_keytab_entry)));
+    ret->principal = principal;
+    ret->key.contents = static_cast<krb5_octet*>(a.copy(entry.key.contents, entry.key.length));
+    return ret;
+}
+
+// Maps the errors of the keytab_file_reader and keytab_file_writer to Kerberos
+// error codes.
+krb5_error_code file_error(int err)
+{
+    return (err == EINVAL) ? KRB5_KT_FORMAT : err;
+}
+
+} // namespace
+
 
 context::context()
     : _ctx(NULL)
+{
+}
+
+context::~context()
+{
+    if(_ctx)
+        krb5_free_context(_ctx);
+}
+
+void context::init() const
 {
     krb5_error_code code;
+    statistics::timer t(statistics::phase_init);
+    statistics::count(statistics::krb5_calls);
+    AKT_PROBE(context__init__start);
     code = krb5_init_context(&_ctx);
+    AKT_PROBE1(context__init__done, code);
     if(code != 0)
+    {
+        _ctx = NULL;
         throw error(NULL, code);
+    }
 }
 
-context::~context()
+// Returns the context of a thread to the pool when the thread exits.
+struct context_pool_slot
+{
+    context * ctx;
+    context_pool_slot() : ctx(NULL) {}
+    ~context_pool_slot()
+    {
+        if(ctx)
+            context_pool::instance().release(ctx);
+    }
+};
+
+namespace {
+    thread_local context_pool_slot current_context;
+}
+
+context_pool::context_pool()
+{
+}
+
+context_pool::~context_pool()
+{
+    for(std::vector<context*>::iterator it = _all.begin(); it != _all.end(); ++it)
+        delete *it;
+}
+
+context_pool & context_pool::instance()
+{
+    static context_pool pool;
+    return pool;
+}
+
+const context & context_pool::acquire()
+{
+    if(!current_context.ctx)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(!_free.empty())
+        {
+            current_context.ctx = _free.back();
+            _free.pop_back();
+        }
+        else
+        {
+            current_context.ctx = new context;
+            _all.push_back(current_context.ctx);
+        }
+    }
+    return *current_context.ctx;
+}
+
+void context_pool::release(context * ctx)
 {
-    krb5_free_context(_ctx);
+    std::lock_guard<std::mutex> lock(_mutex);
+    _free.push_back(ctx);
 }
 
 base_object::base_object(const context & ctx)
@@ -47,11 +477,13 @@ const context & base_object::get_context() const
 error::error(base_object * obj, int error_code)
     : std::exception(), _obj(obj), _msg(), _error_code(error_code)
 {
-    const char * msg = krb5_get_error_message(obj->get_context(), _error_code);
+    // errors of the context itself have no object (and no context)
+    krb5_context ctx = obj ? (krb5_context)obj->get_context() : NULL;
+    const char * msg = krb5_get_error_message(ctx, _error_code);
     if(msg)
     {
         _msg = msg;
-        krb5_free_error_message(obj->get_context(), msg);
+        krb5_free_error_message(ctx, msg);
     }
 }
 
@@ -60,11 +492,12 @@ error::error(base_object * obj, const std::string & msg, int error_code)
 {
     if(msg.empty())
     {
-        const char * msg = krb5_get_error_message(obj->get_context(), _error_code);
+        krb5_context ctx = obj ? (krb5_context)obj->get_context() : NULL;
+        const char * msg = krb5_get_error_message(ctx, _error_code);
         if(msg)
         {
             _msg = msg;
-            krb5_free_error_message(obj->get_context(), msg);
+            krb5_free_error_message(ctx, msg);
         }
     }
 }
@@ -92,7 +525,8 @@ bool principal::operator==(const principal & rhs) const
 
 bool principal::operator<(const principal & rhs) const
 {
-    return (krb5_principal_compare(_ctx, _handle, rhs._handle) < 0);
+    // krb5_principal_compare() only tells whether the principals are equal
+    return name() < rhs.name();
 }
 
 const std::string & principal::name() const
@@ -100,6 +534,8 @@ const std::string & principal::name() const
     if(_name.empty())
     {
         char * output_name = NULL;
+        statistics::timer t(statistics::phase_unparse);
+        statistics::count(statistics::krb5_calls);
         if(krb5_unparse_name(_ctx, _handle, &output_name) == 0)
         {
             const_cast<principal*>(this)->_name = output_name;
@@ -109,6 +545,51 @@ const std::string & principal::name() const
     return _name;
 }
 
+principal_table::principal_table(const context & ctx)
+    : base_object(ctx)
+{
+}
+
+principal_table::principal_table()
+    : base_object(context_pool::instance().acquire())
+{
+}
+
+unsigned principal_table::intern(const principal & p)
+{
+    _key.clear();
+    append_principal_key(_key, p.handle());
+    std::pair<boost::unordered_map<std::string, unsigned>::iterator, bool> r =
+        _ids.insert(std::make_pair(_key, (unsigned)_names.size()));
+    if(r.second)
+    {
+        _names.push_back(p.name());
+        _ranks.clear();
+    }
+    return r.first->second;
+}
+
+unsigned principal_table::rank(unsigned id)
+{
+    if(_ranks.size() != _names.size())
+    {
+        statistics::timer t(statistics::phase_sort);
+        struct by_name {
+            const std::vector<std::string> & _names;
+            by_name(const std::vector<std::string> & names) : _names(names) {}
+            bool operator()(unsigned a, unsigned b) const { return _names[a] < _names[b]; }
+        };
+        std::vector<unsigned> order(_names.size());
+        for(unsigned i = 0; i < order.size(); ++i)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), by_name(_names));
+        _ranks.resize(_names.size());
+        for(unsigned i = 0; i < order.size(); ++i)
+            _ranks[order[i]] = i;
+    }
+    return _ranks[id];
+}
+
 timestamp::timestamp(krb5_timestamp timestamp)
     : _ts(timestamp)
 {
@@ -122,20 +603,82 @@ std::string timestamp::to_string() const
     return std::string();
 }
 
+bool timestamp::to_string(char * buf, size_t size) const
+{
+    return krb5_timestamp_to_string(_ts, buf, size) == 0;
+}
+
+arena::arena(size_t block_size)
+    : _blocks(), _block_size(block_size)
+{
+}
+
+arena::~arena()
+{
+    clear();
+}
+
+void * arena::allocate(size_t size, size_t alignment)
+{
+    if(!_blocks.empty())
+    {
+        block & b = _blocks.back();
+        size_t offset = (b.used + alignment - 1) & ~(alignment - 1);
+        if(offset + size <= b.size)
+        {
+            b.used = offset + size;
+            return b.data + offset;
+        }
+    }
+    block b;
+    b.size = (size > _block_size) ? size : _block_size;
+    b.data = static_cast<char*>(malloc(b.size));
+    if(!b.data)
+        throw std::bad_alloc();
+    statistics::count(statistics::allocations);
+    b.used = size;
+    _blocks.push_back(b);
+    return b.data;
+}
+
+void * arena::copy(const void * data, size_t size, size_t alignment)
+{
+    void * ret = allocate(size ? size : 1, alignment);
+    if(size)
+        memcpy(ret, data, size);
+    return ret;
+}
+
+void arena::clear()
+{
+    for(std::vector<block>::iterator it = _blocks.begin(); it != _blocks.end(); ++it)
+    {
+        explicit_bzero(it->data, it->used);
+        free(it->data);
+    }
+    _blocks.clear();
+}
+
 keytab_entry::keytab_entry(const context & ctx, krb5_keytab_entry * entry)
-    : base_object(ctx), _entry(entry), _allocated(false)
+    : base_object(ctx), _entry(entry)
+{
+}
+
+keytab_entry::keytab_entry(const keytab_entry & rhs, arena & a)
+    : base_object(rhs._ctx), _entry(NULL)
 {
+    if(rhs._entry)
+        _entry = copy_entry(a, *rhs._entry);
 }
 
-keytab_entry::keytab_entry(const keytab_entry & rhs)
-    : base_object(rhs._ctx), _entry(rhs._entry?new krb5_keytab_entry(*rhs._entry):NULL), _allocated(rhs._entry != NULL)
+keytab_entry::keytab_entry(keytab_entry && rhs)
+    : base_object(rhs._ctx), _entry(rhs._entry)
 {
+    rhs._entry = NULL;
 }
 
 keytab_entry::~keytab_entry()
 {
-    if(_allocated)
-        delete _entry;
 }
 
 int keytab_entry::get_magic() const
@@ -162,6 +705,17 @@ int keytab_entry::get_encryption() const
     return _entry->key.enctype;
 }
 
+uint64_t keytab_entry::get_key_fingerprint() const
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for(unsigned i = 0; i < _entry->key.length; ++i)
+    {
+        hash ^= _entry->key.contents[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
 std::string keytab_entry::get_encryption_as_string(bool shortest) const
 {
     char buf[64];
@@ -169,20 +723,44 @@ std::string keytab_entry::get_encryption_as_string(bool shortest) const
     return buf;
 }
 
+bool keytab_entry::get_encryption_as_string(char * buf, size_t size, bool shortest) const
+{
+    return krb5_enctype_to_name(_entry->key.enctype, shortest, buf, size) == 0;
+}
+
+keytab_snapshot::keytab_snapshot()
+    : _arena(256*1024)
+{
+}
+
+void keytab_snapshot::clear()
+{
+    _entries.clear();
+    _arena.clear();
+}
+
 
 keytab::keytab(const context & ctx, const std::string & filename)
-        : base_object(ctx), _handle(NULL), _filename(filename), _ok(false)
+        : base_object(ctx), _handle(NULL), _filename(filename), _ok(false), _filter(NULL), _contents(NULL), _loaded(NULL)
 {
     if(!filename.empty())
     {
+        statistics::count(statistics::krb5_calls);
         krb5_error_code code = krb5_kt_resolve(_ctx, filename.c_str(), &_handle);
         _ok = (code == 0);
         if(!_ok)
             throw error(this, code);
     }
 }
+
+keytab::keytab(const std::string & filename)
+        : keytab(context_pool::instance().acquire(), filename)
+{
+}
+
 keytab::~keytab()
 {
+    unload();
     if(_handle)
         krb5_kt_close(_ctx, _handle);
 }
@@ -197,289 +775,844 @@ const std::string & keytab::get_filename() const
     return _filename;
 }
 
-bool keytab::list(list_handler & handler)
+bool keytab::selected(const krb5_keytab_entry & entry) const
 {
-    bool ret = false;
-    if(_ok)
+    return !_filter || _filter->match(_ctx, entry);
+}
+
+bool keytab::find_indexed(const std::string & path, const std::vector<std::string> & names, const std::vector<std::string> & prefixes,
+                          keytab_file_reader & reader, std::vector<uint64_t> & offsets) const
+{
+    keytab_index index;
+    if(!index.open(path))
     {
-        krb5_kt_cursor cursor = NULL;
-        krb5_keytab_entry entry;
-        krb5_error_code code;
+        // (re)build the index with one scan of the keytab; if it cannot be
+        // written, the keytab is scanned as usual. A keytab which has just
+        // been modified is not indexed, so it is not scanned twice.
+        keytab_index::file_state state;
+        if(!keytab_index::get_state(path, state) || !keytab_index::indexable(state))
+            return false;
+        keytab_file_reader builder;
+        if(builder.open(path) != 0)
+            return false;
+        statistics::count(statistics::cursor_restarts);
+        keytab_index::entry_list entries;
+        keytab_file_entry view;
+        entry_shell shell;
+        while(builder.next(view))
+        {
+            shell.assign(view);
+            char * name = NULL;
+            statistics::timer t(statistics::phase_unparse);
+            statistics::count(statistics::krb5_calls);
+            if(krb5_unparse_name(_ctx, shell.entry.principal, &name) != 0)
+                return false;
+            entries.push_back(keytab_index::entry_list::value_type(name, view.offset));
+            krb5_free_unparsed_name(_ctx, name);
+        }
+        if(builder.failed() || keytab_index::write(path, state, entries) != 0 || !index.open(path))
+            return false;
+    }
+    for(std::vector<std::string>::const_iterator it = names.begin(); it != names.end(); ++it)
+        index.find(*it, offsets);
+    for(std::vector<std::string>::const_iterator it = prefixes.begin(); it != prefixes.end(); ++it)
+        index.find_prefix(*it, offsets);
+    // the keytab is opened after the index, and if it is still the same file
+    // afterwards, it cannot have been replaced in the meantime
+    keytab_index::file_state current;
+    if(reader.open(path) != 0 || !keytab_index::get_state(path, current) || !(current == index.state()))
+    {
+        reader.close();
+        return false;
+    }
+    // read the entries in the order of the keytab
+    std::sort(offsets.begin(), offsets.end());
+    offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+    return true;
+}
 
-        code = krb5_kt_start_seq_get (_ctx, _handle, &cursor);
-        if(code)
-            throw error(this, code);
-        ret = (code == 0);
-        while(!code)
+krb5_error_code keytab::scan(scan_handler & handler, bool apply_filter, const krb5_principal_data * principal) const
+{
+    statistics::timer t(statistics::phase_read);
+    const entry_filter * filter = apply_filter ? _filter : NULL;
+    std::string path;
+    keytab_file_reader reader;
+    keytab_file_entry view;
+    entry_shell shell;
+    std::vector<uint64_t> offsets;
+    bool indexed = false;
+    if(filter && filter->use_index() && !_contents && get_file_keytab_path(_filename, path))
+    {
+        std::vector<std::string> names;
+        std::vector<std::string> prefixes;
+        if(principal)
         {
-            code = krb5_kt_next_entry (_ctx, _handle, &entry, &cursor);
-            if (code == 0)
+            char * name = NULL;
+            statistics::count(statistics::krb5_calls);
+            indexed = (krb5_unparse_name(_ctx, principal, &name) == 0);
+            if(indexed)
             {
-                keytab_entry e(_ctx, &entry);
-                handler(e);
+                names.push_back(name);
+                krb5_free_unparsed_name(_ctx, name);
             }
         }
+        else
+            indexed = filter->get_principal_keys(names, prefixes);
+        indexed = indexed && find_indexed(path, names, prefixes, reader, offsets);
+    }
+    if(indexed)
+    {
+        // only the records of the matching principals are read
+        for(std::vector<uint64_t>::const_iterator it = offsets.begin(); it != offsets.end(); ++it)
+        {
+            reader.seek(*it);
+            if(!reader.next(view))
+                return KRB5_KT_FORMAT;
+            shell.assign(view);
+            if(principal && !krb5_principal_compare(_ctx, principal, shell.entry.principal))
+                continue;
+            if(!filter->match(_ctx, shell.entry))
+                continue;
+            AKT_PROBE3(scan__entry, _filename.c_str(), shell.entry.vno, shell.entry.key.enctype);
+            if(!handler(shell.entry))
+                return 0;
+        }
+        return 0;
+    }
+    // read FILE: keytabs directly and let libkrb5 handle all other types
+    // (and report any problems with the file)
+    if(get_file_keytab_path(_filename, path) &&
+       (_contents ? reader.open(_contents->data(), _contents->size()) : reader.open(path)) == 0)
+    {
+        statistics::count(statistics::cursor_restarts);
+        while(reader.next(view))
+        {
+            shell.assign(view);
+            if(principal && !krb5_principal_compare(_ctx, principal, shell.entry.principal))
+                continue;
+            if(filter && !filter->match(_ctx, shell.entry))
+                continue;
+            AKT_PROBE3(scan__entry, _filename.c_str(), shell.entry.vno, shell.entry.key.enctype);
+            if(!handler(shell.entry))
+                return 0;
+        }
+        return reader.failed() ? KRB5_KT_FORMAT : 0;
+    }
 
-        if (code == KRB5_KT_END)
-            code = 0;
+    krb5_kt_cursor cursor = NULL;
+    krb5_keytab_entry entry;
+    krb5_error_code code;
+    bool proceed = true;
 
-        if(cursor)
-            krb5_kt_end_seq_get (_ctx, _handle, &cursor);
+    statistics::count(statistics::cursor_restarts);
+    statistics::count(statistics::krb5_calls);
+    code = krb5_kt_start_seq_get (_ctx, _handle, &cursor);
+    if(code)
+        return code;
+    while(!code && proceed)
+    {
+        statistics::count(statistics::krb5_calls);
+        code = krb5_kt_next_entry (_ctx, _handle, &entry, &cursor);
+        if (code == 0)
+        {
+            statistics::count(statistics::entries_scanned);
+            if((!principal || krb5_principal_compare(_ctx, principal, entry.principal)) &&
+               (!filter || filter->match(_ctx, entry)))
+            {
+                AKT_PROBE3(scan__entry, _filename.c_str(), entry.vno, entry.key.enctype);
+                proceed = handler(entry);
+            }
 
+            // release all memory
+            krb5_free_keytab_entry_contents(_ctx, &entry);
+        }
     }
-    return ret;
+
+    if (code == KRB5_KT_END)
+        code = 0;
+
+    if(cursor)
+    {
+        statistics::count(statistics::krb5_calls);
+        krb5_kt_end_seq_get (_ctx, _handle, &cursor);
+    }
+    return code;
 }
 
-bool keytab::copy(const keytab & source)
+bool keytab::list(list_handler & handler)
 {
     bool ret = false;
-    if(source._ok)
+    if(_ok)
     {
-        krb5_kt_cursor cursor = NULL;
-        krb5_keytab_entry entry;
-        krb5_error_code code;
-        code = krb5_kt_start_seq_get (source._ctx, source._handle, &cursor);
-        ret = (code == 0);
-        while(!code)
-        {
-            code = krb5_kt_next_entry (source._ctx, source._handle, &entry, &cursor);
-            if (code == 0)
+        struct entry_handler : public scan_handler {
+            const context & _ctx;
+            list_handler & _handler;
+            size_t _count;
+            entry_handler(const context & ctx, list_handler & handler) : _ctx(ctx), _handler(handler), _count(0) {}
+            virtual bool operator()(krb5_keytab_entry & entry)
             {
-                code = krb5_kt_add_entry(_ctx, _handle, &entry);
-                if(code != 0)
-                    ret = false;
+                keytab_entry e(_ctx, &entry);
+                _handler(e);
+                ++_count;
+                return true;
+            }
+        };
+        AKT_PROBE1(list__start, _filename.c_str());
+        entry_handler h(_ctx, handler);
+        krb5_error_code code = scan(h);
+        AKT_PROBE3(list__done, _filename.c_str(), h._count, code);
+        if(code)
+            throw error(this, code);
+        ret = true;
+    }
+    return ret;
+}
 
-                // release all memory
-                krb5_free_keytab_entry_contents(_ctx, &entry);
+bool keytab::snapshot(keytab_snapshot & snapshot)
+{
+    bool ret = false;
+    if(_ok)
+    {
+        struct copy_handler : public scan_handler {
+            keytab_snapshot & _snapshot;
+            copy_handler(keytab_snapshot & snapshot) : _snapshot(snapshot) {}
+            virtual bool operator()(krb5_keytab_entry & entry)
+            {
+                _snapshot._entries.push_back(copy_entry(_snapshot._arena, entry));
+                return true;
             }
+        };
+        snapshot.clear();
+        copy_handler h(snapshot);
+        krb5_error_code code = scan(h);
+        if(code)
+        {
+            snapshot.clear();
+            throw error(this, code);
         }
+        ret = true;
+    }
+    return ret;
+}
 
-        if (code == KRB5_KT_END)
-            code = 0;
+// entries read by load(), in the order of the keytab and indexed by principal
+struct keytab::loaded_entries {
+    typedef boost::unordered_map<std::string, std::vector<const krb5_keytab_entry*> > map_type;
+    keytab_snapshot snapshot;
+    map_type principals;
+};
+
+const int keytab::any_key_version;
+const int keytab::any_encryption;
 
-        if(cursor)
-            krb5_kt_end_seq_get (source._ctx, source._handle, &cursor);
+bool keytab::load()
+{
+    bool ret = false;
+    unload();
+    if(_ok)
+    {
+        std::unique_ptr<loaded_entries> loaded(new loaded_entries);
+        ret = snapshot(loaded->snapshot);
+        std::string key;
+        const std::vector<krb5_keytab_entry*> & entries = loaded->snapshot._entries;
+        loaded->principals.reserve(entries.size());
+        for(std::vector<krb5_keytab_entry*>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+        {
+            key.clear();
+            append_principal_key(key, (*it)->principal);
+            loaded->principals[key].push_back(*it);
+        }
+        _loaded = loaded.release();
     }
     return ret;
 }
 
-bool keytab::update(const keytab & source)
+void keytab::unload()
 {
-    bool ret = false;
-    if(source._ok)
+    delete _loaded;
+    _loaded = NULL;
+}
+
+bool keytab::find(const std::string & principal, int kvno, int enctype)
+{
+    return lookup(principal, kvno, enctype, false, NULL);
+}
+
+bool keytab::find(const std::string & principal, int kvno, int enctype, list_handler & handler)
+{
+    return lookup(principal, kvno, enctype, false, &handler);
+}
+
+bool keytab::find_latest(const std::string & principal, int enctype)
+{
+    return lookup(principal, any_key_version, enctype, true, NULL);
+}
+
+bool keytab::find_latest(const std::string & principal, int enctype, list_handler & handler)
+{
+    return lookup(principal, any_key_version, enctype, true, &handler);
+}
+
+bool keytab::lookup(const std::string & name, int kvno, int enctype, bool latest, list_handler * handler)
+{
+    if(!_ok)
+        return false;
+    krb5_principal principal = NULL;
+    statistics::count(statistics::krb5_calls);
+    krb5_error_code code = krb5_parse_name(_ctx, name.c_str(), &principal);
+    if(code)
+        throw error(this, code);
+
+    struct match_handler : public scan_handler {
+        int _kvno;
+        int _enctype;
+        bool _latest;
+        arena _arena;
+        const krb5_keytab_entry * found;
+        match_handler(int kvno, int enctype, bool latest)
+            : _kvno(kvno), _enctype(enctype), _latest(latest), _arena(1024), found(NULL) {}
+        bool better(const krb5_keytab_entry & entry) const
+        {
+            if(_kvno != any_key_version && entry.vno != (krb5_kvno)_kvno)
+                return false;
+            if(_enctype != any_encryption && entry.key.enctype != _enctype)
+                return false;
+            return !found || entry.vno > found->vno;
+        }
+        virtual bool operator()(krb5_keytab_entry & entry)
+        {
+            if(!better(entry))
+                return true;
+            // the scanned entry is only valid during this call
+            found = copy_entry(_arena, entry);
+            // without looking for the latest kvno the first match is enough
+            return _latest;
+        }
+    };
+    match_handler h(kvno, enctype, latest);
+    if(_loaded)
     {
-        krb5_kt_cursor cursor = NULL;
-        krb5_keytab_entry entry;
-        krb5_error_code code;
-        code = krb5_kt_start_seq_get (source._ctx, source._handle, &cursor);
-        ret = (code == 0);
-        while(!code)
+        std::string key;
+        append_principal_key(key, principal);
+        loaded_entries::map_type::const_iterator it = _loaded->principals.find(key);
+        if(it != _loaded->principals.end())
         {
-            code = krb5_kt_next_entry (source._ctx, source._handle, &entry, &cursor);
-            if (code == 0)
+            for(std::vector<const krb5_keytab_entry*>::const_iterator e = it->second.begin(); e != it->second.end(); ++e)
             {
-                updateEntry(&entry);
+                if(!h.better(**e))
+                    continue;
+                h.found = *e;
+                if(!latest)
+                    break;
+            }
+        }
+    }
+    else
+        code = scan(h, true, principal);
+    krb5_free_principal(_ctx, principal);
+    if(code)
+        throw error(this, code);
+    if(h.found && handler)
+    {
+        keytab_entry e(_ctx, const_cast<krb5_keytab_entry*>(h.found));
+        (*handler)(e);
+    }
+    return h.found != NULL;
+}
 
-                // release all memory
-                krb5_free_keytab_entry_contents(_ctx, &entry);
+// passes the entries of another keytab to update() and copy()
+struct keytab::keytab_source : public keytab::entry_source {
+    const keytab & _keytab;
+    keytab_source(const keytab & kt) : _keytab(kt) {}
+    virtual bool valid() const { return _keytab._ok; }
+    virtual krb5_error_code scan(scan_handler & handler) const { return _keytab.scan(handler); }
+};
+
+// passes the entries of one or more snapshots to update() and copy()
+struct keytab::snapshot_source : public keytab::entry_source {
+    const keytab_snapshot * const * _begin;
+    const keytab_snapshot * const * _end;
+    snapshot_source(const keytab_snapshot * const * begin, const keytab_snapshot * const * end) : _begin(begin), _end(end) {}
+    virtual bool valid() const { return true; }
+    virtual krb5_error_code scan(scan_handler & handler) const
+    {
+        for(const keytab_snapshot * const * snapshot = _begin; snapshot != _end; ++snapshot)
+        {
+            const std::vector<krb5_keytab_entry*> & entries = (*snapshot)->_entries;
+            for(std::vector<krb5_keytab_entry*>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+            {
+                if(!handler(**it))
+                    return 0;
             }
         }
+        return 0;
+    }
+};
 
-        if (code == KRB5_KT_END)
-            code = 0;
+bool keytab::copy(const keytab & source)
+{
+    keytab_source s(source);
+    return copy(static_cast<const entry_source &>(s));
+}
 
-        if(cursor)
-            krb5_kt_end_seq_get (source._ctx, source._handle, &cursor);
+bool keytab::copy(const keytab_snapshot & source)
+{
+    const keytab_snapshot * sources = &source;
+    snapshot_source s(&sources, &sources + 1);
+    return copy(static_cast<const entry_source &>(s));
+}
+
+bool keytab::copy(const entry_source & source)
+{
+    unload();
+    bool ret = false;
+    if(source.valid())
+    {
+        std::string path;
+        if(get_file_keytab_path(_filename, path))
+        {
+            struct add_handler : public scan_handler {
+                keytab_file_writer & _writer;
+                keytab_file_entry _view;
+                add_handler(keytab_file_writer & writer) : _writer(writer) {}
+                virtual bool operator()(krb5_keytab_entry & entry)
+                {
+                    assign_view(_view, entry);
+                    _writer.add(_view);
+                    return true;
+                }
+            };
+            keytab_file_writer writer;
+            int err = writer.open(path);
+            if(err)
+                throw error(this, file_error(err));
+            add_handler h(writer);
+            ret = (source.scan(h) == 0);
+            // never write a keytab with only a part of the source
+            if(!ret)
+                writer.close();
+            else if((err = writer.commit()) != 0)
+                throw error(this, file_error(err));
+        }
+        else
+        {
+            struct add_handler : public scan_handler {
+                const keytab & _keytab;
+                bool _ok;
+                add_handler(const keytab & kt) : _keytab(kt), _ok(true) {}
+                virtual bool operator()(krb5_keytab_entry & entry)
+                {
+                    statistics::timer t(statistics::phase_write);
+                    statistics::count(statistics::krb5_calls);
+                    if(krb5_kt_add_entry(_keytab._ctx, _keytab._handle, &entry) != 0)
+                        _ok = false;
+                    else
+                        audit_entry(audit_log::operation_add, _keytab._filename, entry);
+                    return true;
+                }
+            };
+            add_handler h(*this);
+            ret = (source.scan(h) == 0) && h._ok;
+        }
     }
     return ret;
 }
 
-krb5_error_code keytab::updateEntry(krb5_keytab_entry * updatedEntry)
+bool keytab::update(const keytab & source)
 {
-    krb5_kt_cursor cursor = NULL;
-    krb5_keytab_entry entry;
-    krb5_error_code code;
-    bool add_princ = true;
+    keytab_source s(source);
+    return update(static_cast<const entry_source &>(s));
+}
 
-    code = krb5_kt_start_seq_get (_ctx, _handle, &cursor);
-    while(!code && add_princ)
+bool keytab::update(const keytab_snapshot & source)
+{
+    const keytab_snapshot * sources = &source;
+    snapshot_source s(&sources, &sources + 1);
+    return update(static_cast<const entry_source &>(s));
+}
+
+bool keytab::update(const std::vector<const keytab_snapshot*> & sources)
+{
+    if(sources.empty())
+        return true;
+    snapshot_source s(&sources.front(), &sources.front() + sources.size());
+    return update(static_cast<const entry_source &>(s));
+}
+
+bool keytab::update(const entry_source & source)
+{
+    unload();
+    bool ret = false;
+    if(source.valid())
     {
-        code = krb5_kt_next_entry (_ctx, _handle, &entry, &cursor);
-        if (code == 0)
+        AKT_PROBE1(update__start, _filename.c_str());
+        std::string path;
+        version_index index;
+        if(get_file_keytab_path(_filename, path))
         {
-            if(krb5_principal_compare(_ctx, entry.principal, updatedEntry->principal) && entry.key.enctype == updatedEntry->key.enctype)
+            struct update_handler : public scan_handler {
+                keytab_file_writer & _writer;
+                version_index & _index;
+                keytab_file_entry _view;
+                update_handler(keytab_file_writer & writer, version_index & index) : _writer(writer), _index(index) {}
+                virtual bool operator()(krb5_keytab_entry & entry)
+                {
+                    if(_index.accept(entry))
+                    {
+                        AKT_PROBE2(update__add, entry.vno, entry.key.enctype);
+                        assign_view(_view, entry);
+                        _writer.add(_view);
+                    }
+                    return true;
+                }
+            };
+            keytab_file_writer writer;
+            int err = writer.open(path);
+            if(err)
+                throw error(this, file_error(err));
+
+            // the destination has been read exactly once by the writer
+            keytab_file_entry view;
+            entry_shell shell;
+            for(size_t i = 0; i < writer.size(); ++i)
             {
-                if(entry.vno > updatedEntry->vno)
+                writer.get(i, view);
+                shell.assign(view);
+                index.insert(shell.entry);
+            }
+
+            // stream the source through the index and only add the winning entries
+            update_handler h(writer, index);
+            ret = (source.scan(h) == 0);
+            // never write a keytab with only a part of the source
+            if(!ret)
+                writer.close();
+            else if((err = writer.commit()) != 0)
+                throw error(this, file_error(err));
+        }
+        else
+        {
+            struct index_handler : public scan_handler {
+                version_index & _index;
+                index_handler(version_index & index) : _index(index) {}
+                virtual bool operator()(krb5_keytab_entry & entry)
                 {
-                    // newer key entry with higher kvno is already in the keytab
-                    add_princ = false;
+                    _index.insert(entry);
+                    return true;
                 }
-                else if(entry.vno == updatedEntry->vno)
+            };
+            struct update_handler : public scan_handler {
+                const keytab & _keytab;
+                version_index & _index;
+                bool _ok;
+                update_handler(const keytab & kt, version_index & index) : _keytab(kt), _index(index), _ok(true) {}
+                virtual bool operator()(krb5_keytab_entry & entry)
                 {
-                    // found same kvno, so check timestamp
-                    if(entry.timestamp >= updatedEntry->timestamp)
+                    if(_index.accept(entry))
                     {
-                        // same kvno but a new (or same) timestamp already in keytab
-                        add_princ = false;
+                        AKT_PROBE2(update__add, entry.vno, entry.key.enctype);
+                        statistics::timer t(statistics::phase_write);
+                        statistics::count(statistics::krb5_calls);
+                        if(krb5_kt_add_entry(_keytab._ctx, _keytab._handle, &entry) != 0)
+                            _ok = false;
+                        else
+                            audit_entry(audit_log::operation_add, _keytab._filename, entry);
                     }
+                    return true;
                 }
-            }
-            // release all memory
-            krb5_free_keytab_entry_contents(_ctx, &entry);
+            };
+            // read the destination only once; a missing keytab is simply empty
+            index_handler ih(index);
+            scan(ih, false);
+
+            // stream the source through the index and only add the winning entries
+            update_handler h(*this, index);
+            ret = (source.scan(h) == 0) && h._ok;
         }
+        AKT_PROBE2(update__done, _filename.c_str(), ret);
     }
+    return ret;
+}
 
-    if (code == KRB5_KT_END)
-        code = 0;
-    if(cursor)
-        krb5_kt_end_seq_get (_ctx, _handle, &cursor);
-    if(add_princ)
-        code = krb5_kt_add_entry(_ctx, _handle, updatedEntry);
+krb5_error_code keytab::updateEntry(krb5_keytab_entry * updatedEntry)
+{
+    krb5_error_code code;
+    std::string path;
+    AKT_PROBE3(update_entry__start, _filename.c_str(), updatedEntry->vno, updatedEntry->key.enctype);
+    version_index index;
+    struct index_handler : public scan_handler {
+        version_index & _index;
+        index_handler(version_index & index) : _index(index) {}
+        virtual bool operator()(krb5_keytab_entry & entry)
+        {
+            _index.insert(entry);
+            return true;
+        }
+    };
+    if(get_file_keytab_path(_filename, path))
+    {
+        keytab_file_writer writer;
+        int err = writer.open(path);
+        if(err)
+            return file_error(err);
+
+        keytab_file_entry view;
+        entry_shell shell;
+        for(size_t i = 0; i < writer.size(); ++i)
+        {
+            writer.get(i, view);
+            shell.assign(view);
+            index.insert(shell.entry);
+        }
+        if(index.accept(*updatedEntry))
+        {
+            assign_view(view, *updatedEntry);
+            writer.add(view);
+        }
+        code = file_error(writer.commit());
+    }
     else
-        code = 0;
+    {
+        index_handler ih(index);
+        scan(ih, false);
+        if(index.accept(*updatedEntry))
+        {
+            statistics::timer t(statistics::phase_write);
+            statistics::count(statistics::krb5_calls);
+            code = krb5_kt_add_entry(_ctx, _handle, updatedEntry);
+            if(!code)
+                audit_entry(audit_log::operation_add, _filename, *updatedEntry);
+        }
+        else
+            code = 0;
+    }
+    AKT_PROBE2(update_entry__done, _filename.c_str(), code);
     return code;
 }
 
 bool keytab::removeEntries(const std::vector<krb5_keytab_entry> & entries_to_remove)
 {
+    unload();
     bool ret = true;
     if(!entries_to_remove.empty())
     {
-        krb5_error_code code;
-        for(std::vector<krb5_keytab_entry>::const_iterator it = entries_to_remove.begin(); it != entries_to_remove.end(); ++it)
+        AKT_PROBE2(remove__start, _filename.c_str(), entries_to_remove.size());
+        std::string path;
+        if(get_file_keytab_path(_filename, path))
         {
-            const krb5_keytab_entry & entry = *it;
-            code = krb5_kt_remove_entry(_ctx, _handle, const_cast<krb5_keytab_entry *>(&entry));
-            if(code)
-                throw error(this, code);
+            // every entry to remove matches the first remaining entry with the
+            // same principal, kvno and enctype, just like krb5_kt_remove_entry()
+            typedef boost::unordered_map<std::string, size_t> map_type;
+            map_type pending;
+            std::string key;
+            for(std::vector<krb5_keytab_entry>::const_iterator it = entries_to_remove.begin(); it != entries_to_remove.end(); ++it)
+            {
+                key.clear();
+                append_principal_key(key, it->principal);
+                key.append(reinterpret_cast<const char*>(&it->vno), sizeof(it->vno));
+                key.append(reinterpret_cast<const char*>(&it->key.enctype), sizeof(it->key.enctype));
+                ++pending[key];
+            }
 
-            // release all memory
-            krb5_free_keytab_entry_contents(_ctx, const_cast<krb5_keytab_entry *>(&entry));
+            keytab_file_writer writer;
+            int err = writer.open(path);
+            if(err)
+                throw error(this, file_error(err));
+            keytab_file_entry view;
+            entry_shell shell;
+            for(size_t i = 0; i < writer.size(); ++i)
+            {
+                writer.get(i, view);
+                shell.assign(view);
+                key.clear();
+                append_principal_key(key, shell.entry.principal);
+                key.append(reinterpret_cast<const char*>(&shell.entry.vno), sizeof(shell.entry.vno));
+                key.append(reinterpret_cast<const char*>(&shell.entry.key.enctype), sizeof(shell.entry.key.enctype));
+                map_type::iterator found = pending.find(key);
+                if(found != pending.end() && found->second)
+                {
+                    AKT_PROBE2(remove__entry, shell.entry.vno, shell.entry.key.enctype);
+                    --found->second;
+                    writer.remove(i);
+                }
+            }
+            err = writer.commit();
+            if(err)
+                throw error(this, file_error(err));
         }
+        else
+        {
+            krb5_error_code code;
+            for(std::vector<krb5_keytab_entry>::const_iterator it = entries_to_remove.begin(); it != entries_to_remove.end(); ++it)
+            {
+                const krb5_keytab_entry & entry = *it;
+                AKT_PROBE2(remove__entry, entry.vno, entry.key.enctype);
+                statistics::timer t(statistics::phase_write);
+                statistics::count(statistics::krb5_calls);
+                code = krb5_kt_remove_entry(_ctx, _handle, const_cast<krb5_keytab_entry *>(&entry));
+                if(code)
+                    throw error(this, code);
+                audit_entry(audit_log::operation_remove, _filename, entry);
+            }
+        }
+        AKT_PROBE1(remove__done, _filename.c_str());
     }
     return ret;
 }
 
 bool keytab::expunge()
 {
+    unload();
     bool ret = false;
     if(_ok)
     {
-        krb5_kt_cursor cursor = NULL;
-        krb5_keytab_entry entry;
-        krb5_error_code code;
-        std::vector<krb5_keytab_entry> entries_to_remove;
-        code = krb5_kt_start_seq_get (_ctx, _handle, &cursor);
-        ret = (code == 0);
-        while(!code)
-        {
-            code = krb5_kt_next_entry (_ctx, _handle, &entry, &cursor);
-            if (code == 0)
+        // the newest kvno is determined from all entries, but only entries
+        // matching the filter are removed
+        struct group_handler : public scan_handler {
+            const keytab & _keytab;
+            expunge_table & _table;
+            bool _ok;
+            group_handler(const keytab & kt, expunge_table & table) : _keytab(kt), _table(table), _ok(true) {}
+            virtual bool operator()(krb5_keytab_entry & entry)
             {
-                krb5_kt_cursor inner_cursor = NULL;
-                krb5_keytab_entry inner_entry;
-                code = krb5_kt_start_seq_get (_ctx, _handle, &inner_cursor);
-                ret = (code == 0);
-                while(!code)
-                {
-                    bool free_inner_entry = true;
-                    code = krb5_kt_next_entry (_ctx, _handle, &inner_entry, &inner_cursor);
-                    if (code == 0)
-                    {
-                        if( entry.magic == inner_entry.magic &&
-                            entry.key.enctype == inner_entry.key.enctype &&
-                            entry.key.length == inner_entry.key.length &&
-                            entry.vno == inner_entry.vno &&
-                            krb5_principal_compare(_ctx, entry.principal, inner_entry.principal) &&
-                            memcmp(entry.key.contents, entry.key.contents, entry.key.length) == 0 &&
-                            1
-                            )
-                        {
-                            //cout << "Found same entry" << endl;
-                        }
-                        else if(
-                            entry.magic == inner_entry.magic &&
-                            entry.key.enctype == inner_entry.key.enctype &&
-                            entry.vno > inner_entry.vno &&
-                            krb5_principal_compare(_ctx, entry.principal, inner_entry.principal)
-                            )
-                        {
-                            // keep the memory of the entry alive
-                            free_inner_entry = false;
-                            entries_to_remove.push_back(inner_entry);
-                        }
-
-                        if(free_inner_entry)
-                        {
-                            // release all memory
-                            krb5_free_keytab_entry_contents(_ctx, &inner_entry);
-                        }
-                    }
-                }
-                if(inner_cursor)
-                    krb5_kt_end_seq_get (_ctx, _handle, &inner_cursor);
-
-                // reset any error of the second pass
-                code = 0;
-
-                // release all memory
-                krb5_free_keytab_entry_contents(_ctx, &entry);
+                if(_table.insert(entry, _keytab.selected(entry)) != 0)
+                    _ok = false;
+                return true;
             }
-        }
-
-        if (code == KRB5_KT_END)
-            code = 0;
-
-        if(cursor)
-            krb5_kt_end_seq_get (_ctx, _handle, &cursor);
+        };
+        AKT_PROBE1(expunge__start, _filename.c_str());
+        expunge_table table(_ctx);
+        group_handler h(*this, table);
+        ret = (scan(h, false) == 0) && h._ok;
 
+        std::vector<krb5_keytab_entry> entries_to_remove;
+        table.obsolete_entries(entries_to_remove);
         if(!removeEntries(entries_to_remove))
             ret = false;
+        AKT_PROBE3(expunge__done, _filename.c_str(), entries_to_remove.size(), ret);
     }
     return ret;
 }
 
+bool keytab::compact(size_t & reclaimed)
+{
+    unload();
+    reclaimed = 0;
+    if(!_ok)
+        return false;
+    std::string path;
+    if(!get_file_keytab_path(_filename, path))
+        return true;
+    keytab_file_writer writer;
+    int err = writer.open(path);
+    if(err)
+        throw error(this, file_error(err));
+    // entries written in an older format might grow, so the keytab is only
+    // rewritten if it actually shrinks
+    const size_t size = writer.compacted_size();
+    if(writer.original_size() > size)
+    {
+        writer.compact();
+        reclaimed = writer.original_size() - size;
+    }
+    err = writer.commit();
+    if(err)
+    {
+        reclaimed = 0;
+        throw error(this, file_error(err));
+    }
+    return true;
+}
+
 bool keytab::remove(const std::string & principal)
 {
+    return remove(std::vector<std::string>(1, principal));
+}
+
+bool keytab::remove(const std::vector<std::string> & principals)
+{
+    unload();
     bool ret = false;
     if(_ok)
     {
-        krb5_kt_cursor cursor = NULL;
-        krb5_keytab_entry entry;
-        krb5_error_code code;
-        krb5_principal kprincipal;
-
-        code = krb5_parse_name(_ctx, principal.c_str(), &kprincipal);
-        ret = (code == 0);
-        if(ret)
+        // without principals all entries matching the filter are removed, but
+        // never all entries of the keytab
+        const bool all = principals.empty();
+        if(all && !_filter)
+            return true;
+        principal_matcher matcher(_ctx);
+        ret = true;
+        for(std::vector<std::string>::const_iterator it = principals.begin(); ret && it != principals.end(); ++it)
+            ret = (matcher.add(*it) == 0);
+        if(!ret)
+            return false;
+
+        std::string path;
+        if(get_file_keytab_path(_filename, path))
         {
-            std::vector<krb5_keytab_entry> entries_to_remove;
-            code = krb5_kt_start_seq_get (_ctx, _handle, &cursor);
-            ret = (code == 0);
-            while(!code)
+            // read, match and write the keytab only once
+            keytab_file_writer writer;
+            int err = writer.open(path);
+            if(err)
+                throw error(this, file_error(err));
+            keytab_file_entry view;
+            entry_shell shell;
+            for(size_t i = 0; i < writer.size(); ++i)
             {
-                code = krb5_kt_next_entry (_ctx, _handle, &entry, &cursor);
-                if (code == 0)
+                writer.get(i, view);
+                shell.assign(view);
+                if((all || matcher.match(shell.entry.principal)) && selected(shell.entry))
+                    writer.remove(i);
+            }
+            err = writer.commit();
+            if(err)
+                throw error(this, file_error(err));
+        }
+        else
+        {
+            // collect the matching entries with their own copy of the principal
+            // and remove them in one batch
+            struct match_handler : public scan_handler {
+                const context & _ctx;
+                principal_matcher & _matcher;
+                bool _all;
+                std::vector<krb5_keytab_entry> & _entries;
+                match_handler(const context & ctx, principal_matcher & matcher, bool all, std::vector<krb5_keytab_entry> & entries)
+                    : _ctx(ctx), _matcher(matcher), _all(all), _entries(entries) {}
+                virtual bool operator()(krb5_keytab_entry & entry)
                 {
-                    if(krb5_principal_compare(_ctx, entry.principal, kprincipal))
+                    if(_all || _matcher.match(entry.principal))
                     {
-                        entries_to_remove.push_back(entry);
-                    }
-                    else
-                    {
-                        // release all memory
-                        krb5_free_keytab_entry_contents(_ctx, &entry);
+                        krb5_keytab_entry match;
+                        memset(&match, 0, sizeof(match));
+                        if(krb5_copy_principal(_ctx, entry.principal, &match.principal) == 0)
+                        {
+                            match.magic = entry.magic;
+                            match.vno = entry.vno;
+                            match.key.enctype = entry.key.enctype;
+                            _entries.push_back(match);
+                        }
                     }
+                    return true;
                 }
-            }
-
-            krb5_free_principal(_ctx, kprincipal);
-
-            if(cursor)
-                krb5_kt_end_seq_get (_ctx, _handle, &cursor);
+            };
+            std::vector<krb5_keytab_entry> entries_to_remove;
+            match_handler h(_ctx, matcher, all, entries_to_remove);
+            ret = (scan(h) == 0);
 
-            if(!removeEntries(entries_to_remove))
-                ret = false;
+            try
+            {
+                if(!removeEntries(entries_to_remove))
+                    ret = false;
+            }
+            catch(...)
+            {
+                for(std::vector<krb5_keytab_entry>::iterator it = entries_to_remove.begin(); it != entries_to_remove.end(); ++it)
+                    krb5_free_principal(_ctx, it->principal);
+                throw;
+            }
+            for(std::vector<krb5_keytab_entry>::iterator it = entries_to_remove.begin(); it != entries_to_remove.end(); ++it)
+                krb5_free_principal(_ctx, it->principal);
         }
     }
     return ret;
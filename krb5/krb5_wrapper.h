@@ -3,6 +3,8 @@
 #include <string>
 #include <vector>
 #include <stdint.h>
+#include <mutex>
+#include <boost/unordered_map.hpp>
 
 typedef int32_t krb5_timestamp;
 typedef int32_t krb5_error_code;
@@ -23,16 +25,45 @@ typedef struct _krb5_kt *krb5_keytab;
 namespace arsoft {
     namespace krb5 {
 
+// Wrapper for a krb5_context. The Kerberos library is initialized on first use
+// of the context, so creating a context is cheap. A context must only be used
+// by one thread at a time; use context_pool to get a context for the current
+// thread.
 class context
 {
 private:
-    krb5_context _ctx;
+    mutable krb5_context _ctx;
+    mutable std::once_flag _init;
+    void init() const;
 public:
     context();
     ~context();
+    context(const context & rhs) = delete;
+    context & operator=(const context & rhs) = delete;
 
     operator krb5_context() const
-        { return _ctx; }
+    {
+        std::call_once(_init, &context::init, this);
+        return _ctx;
+    }
+};
+
+// Provides one context per thread. The context of a thread is returned to the
+// pool when the thread exits and is reused by the next thread which acquires a
+// context, so the configuration is not parsed again for every thread.
+class context_pool
+{
+    std::mutex _mutex;
+    std::vector<context*> _free;
+    std::vector<context*> _all;
+    context_pool();
+    ~context_pool();
+    friend struct context_pool_slot;
+    void release(context * ctx);
+public:
+    static context_pool & instance();
+    // returns the context of the calling thread
+    const context & acquire();
 };
 
 class base_object
@@ -77,10 +108,53 @@ public:
     bool operator!=(const principal & rhs) const;
     bool operator<(const principal & rhs) const;
 
+    const krb5_principal & handle() const { return _handle; }
     const std::string & name() const;
     operator std::string() const { return name(); }
 };
 
+// Interns principals: every distinct principal is unparsed only once, stored in
+// the table and identified by a stable id. The ids can be ordered through a
+// collation rank, so sorting entries by principal only compares integers.
+class principal_table : public base_object
+{
+    boost::unordered_map<std::string, unsigned> _ids;
+    std::vector<std::string> _names;
+    std::vector<unsigned> _ranks;
+    std::string _key;
+public:
+    principal_table(const context & ctx);
+    principal_table();
+
+    // returns the id of the given principal and adds it to the table if needed
+    unsigned intern(const principal & p);
+    size_t size() const { return _names.size(); }
+    const std::string & name(unsigned id) const { return _names[id]; }
+    // returns the position of the principal in the sorted list of all names in
+    // the table; the ranks are computed once after a principal has been added.
+    unsigned rank(unsigned id);
+};
+
+// Sorts entries by (principal, kvno, enctype) and keeps entries which are
+// equal in all three in their original order; the principal is represented
+// by its rank in a principal_table and index is the position of the entry.
+struct entry_sort_key {
+    unsigned principal_rank;
+    unsigned key_version;
+    int encryption;
+    unsigned index;
+    bool operator<(const entry_sort_key & rhs) const
+    {
+        if(principal_rank != rhs.principal_rank)
+            return principal_rank < rhs.principal_rank;
+        if(key_version != rhs.key_version)
+            return key_version < rhs.key_version;
+        if(encryption != rhs.encryption)
+            return encryption < rhs.encryption;
+        return index < rhs.index;
+    }
+};
+
 class timestamp
 {
 protected:
@@ -88,7 +162,10 @@ protected:
 public:
     timestamp(krb5_timestamp timestamp=0);
 
+    krb5_timestamp value() const { return _ts; }
     std::string to_string() const;
+    // formats the timestamp into the given buffer without allocating memory
+    bool to_string(char * buf, size_t size) const;
 
     bool operator<(const timestamp & rhs) const
     {
@@ -104,13 +181,46 @@ public:
     }
 };
 
+// Simple bump allocator for the data of many small objects which share the same
+// lifetime, e.g. all entries collected during one operation. All memory is
+// wiped and released at once when the arena is cleared or destroyed, so no key
+// material is left behind in the heap.
+class arena
+{
+    struct block {
+        char * data;
+        size_t size;
+        size_t used;
+    };
+    std::vector<block> _blocks;
+    size_t _block_size;
+public:
+    explicit arena(size_t block_size=64*1024);
+    ~arena();
+    arena(const arena & rhs) = delete;
+    arena & operator=(const arena & rhs) = delete;
+
+    void * allocate(size_t size, size_t alignment=sizeof(void*));
+    void * copy(const void * data, size_t size, size_t alignment=1);
+    // wipes and releases all allocated memory
+    void clear();
+};
+
+// A keytab entry either references an entry owned by someone else (e.g. the
+// entry passed to a list_handler, which is only valid during the call) or an
+// entry whose principal and key have been copied into an arena. Entries can be
+// moved but not copied or assigned, because every object is bound to its
+// context.
 class keytab_entry : public base_object
 {
     krb5_keytab_entry * _entry;
-    bool _allocated;
 public:
     keytab_entry(const context & ctx, krb5_keytab_entry * entry);
-    keytab_entry(const keytab_entry & rhs);
+    // copies the entry including its principal and key into the given arena
+    keytab_entry(const keytab_entry & rhs, arena & a);
+    keytab_entry(keytab_entry && rhs);
+    keytab_entry(const keytab_entry & rhs) = delete;
+    keytab_entry & operator=(const keytab_entry & rhs) = delete;
     ~keytab_entry();
 
     int get_magic() const;
@@ -118,45 +228,166 @@ public:
     principal get_principal() const;
     timestamp get_timestamp() const;
     int get_encryption() const;
+    // 64-bit FNV-1a hash of the key, for comparing keys without exposing them
+    uint64_t get_key_fingerprint() const;
     std::string get_encryption_as_string(bool shortest=false) const;
+    bool get_encryption_as_string(char * buf, size_t size, bool shortest=false) const;
 };
 
+// In-memory copy of all entries of a keytab. The source keytab is read only
+// once and the snapshot can then be used to update any number of keytabs, also
+// from several threads at the same time.
+class keytab_snapshot
+{
+    arena _arena;
+    std::vector<krb5_keytab_entry*> _entries;
+    friend class keytab;
+public:
+    keytab_snapshot();
+    keytab_snapshot(const keytab_snapshot & rhs) = delete;
+    keytab_snapshot & operator=(const keytab_snapshot & rhs) = delete;
+
+    size_t size() const { return _entries.size(); }
+    bool empty() const { return _entries.empty(); }
+    // wipes and releases all entries
+    void clear();
+};
+
+class entry_filter;
+class keytab_file_reader;
+
 class keytab : public base_object
 {
     krb5_keytab _handle;
     std::string _filename;
     bool _ok;
+    const entry_filter * _filter;
+    const std::string * _contents;
+    struct loaded_entries;
+    loaded_entries * _loaded;
 public:
     keytab(const context & ctx, const std::string & filename);
+    // uses the context of the calling thread
+    keytab(const std::string & filename);
     ~keytab();
+    keytab(const keytab & rhs) = delete;
+    keytab & operator=(const keytab & rhs) = delete;
     bool valid() const;
     const std::string & get_filename() const;
 
+    // restricts list(), snapshot(), remove() and expunge() of this keytab, and
+    // update() and copy() from this keytab, to the entries matching the given
+    // filter. The filter is not copied and must outlive the keytab.
+    void set_filter(const entry_filter * filter) { _filter = filter; }
+    // all reads of a FILE: keytab parse the given contents of the keytab file
+    // (e.g. from a keytab_file_loader) instead of the file itself; writes
+    // still load the file under its lock. The contents are not copied and
+    // must outlive the keytab.
+    void set_contents(const std::string * contents) { _contents = contents; }
+
     struct list_handler {
         virtual void operator()(const keytab_entry & entry) = 0;
     };
     bool list(list_handler & handler);
 
+    template<typename LIST_HANDLER>
+    struct list_handler_adapter : public list_handler {
+        LIST_HANDLER & _handler;
+        list_handler_adapter(LIST_HANDLER & handler) : _handler(handler) {}
+        virtual void operator()(const keytab_entry & entry)
+        {
+            _handler(entry);
+        }
+    };
     template<typename LIST_HANDLER>
     bool list(LIST_HANDLER & handler)
     {
-        struct list_handler_impl : public list_handler {
-            LIST_HANDLER & _handler;
-            list_handler_impl(LIST_HANDLER & handler) : _handler(handler) {}
-            virtual void operator()(const keytab_entry & entry)
-            {
-                _handler(entry);
-            }
-        };
-        list_handler_impl impl(handler);
+        list_handler_adapter<LIST_HANDLER> impl(handler);
         return list(static_cast<list_handler & >(impl));
     }
+    // reads all entries of the keytab into the given snapshot
+    bool snapshot(keytab_snapshot & snapshot);
+
+    // wildcards for the kvno and enctype of find()
+    static const int any_key_version = -1;
+    static const int any_encryption = -1;
+    // point lookups of a single entry: find() passes the first entry of the
+    // given principal (a name as accepted by krb5_parse_name) with the given
+    // kvno and enctype to the handler, find_latest() the one with the highest
+    // kvno. Both return false if there is no such entry; the handler is
+    // optional. Entries are looked up in the in-memory index built by load(),
+    // otherwise in the sidecar index if the filter asks for it, otherwise the
+    // keytab is scanned, and find() stops at the first match.
+    bool find(const std::string & principal, int kvno=any_key_version, int enctype=any_encryption);
+    bool find(const std::string & principal, int kvno, int enctype, list_handler & handler);
+    bool find_latest(const std::string & principal, int enctype=any_encryption);
+    bool find_latest(const std::string & principal, int enctype, list_handler & handler);
+    template<typename LIST_HANDLER>
+    bool find(const std::string & principal, int kvno, int enctype, LIST_HANDLER & handler)
+    {
+        list_handler_adapter<LIST_HANDLER> impl(handler);
+        return find(principal, kvno, enctype, static_cast<list_handler & >(impl));
+    }
+    template<typename LIST_HANDLER>
+    bool find_latest(const std::string & principal, int enctype, LIST_HANDLER & handler)
+    {
+        list_handler_adapter<LIST_HANDLER> impl(handler);
+        return find_latest(principal, enctype, static_cast<list_handler & >(impl));
+    }
+    // reads all entries (matching the filter) into memory and indexes them by
+    // principal, so any number of find() calls do not read the keytab again.
+    // The loaded entries are dropped by unload() and by all modifications
+    // through this object.
+    bool load();
+    void unload();
     bool update(const keytab & source);
+    bool update(const keytab_snapshot & source);
+    // merges the entries of all sources (in the given order) with the same
+    // rules as update(), but the keytab is written only once
+    bool update(const std::vector<const keytab_snapshot*> & sources);
     bool copy(const keytab & source);
+    bool copy(const keytab_snapshot & source);
     bool expunge();
+    // rewrites a FILE: keytab with only its live entries if holes left by
+    // removed entries (e.g. by libkrb5 or kadmin) or unused space within
+    // records can be reclaimed. The number of bytes the file has shrunk is
+    // stored in reclaimed. Other keytab types are left alone.
+    bool compact(size_t & reclaimed);
     bool remove(const std::string & principal);
+    // removes all entries of the given principals with a single scan and a
+    // single write of the keytab. Principals may contain glob patterns; a
+    // pattern without realm only matches the default realm. If a filter is
+    // set, only matching entries are removed, and an empty list of principals
+    // removes all matching entries.
+    bool remove(const std::vector<std::string> & principals);
 
 protected:
+    struct scan_handler {
+        // returns false to stop the scan
+        virtual bool operator()(krb5_keytab_entry & entry) = 0;
+    };
+    // passes every entry of the keytab (or only the entries matching the
+    // filter and, if given, the principal) to the given handler; FILE:
+    // keytabs are read directly, all other types through libkrb5.
+    krb5_error_code scan(scan_handler & handler, bool apply_filter=true, const krb5_principal_data * principal=NULL) const;
+    // looks up the offsets of the entries with the given principal names or
+    // name prefixes in the index of the keytab file and opens the keytab file
+    // the index belongs to; returns false if the keytab has to be scanned
+    bool find_indexed(const std::string & path, const std::vector<std::string> & names, const std::vector<std::string> & prefixes,
+                      keytab_file_reader & reader, std::vector<uint64_t> & offsets) const;
+    bool lookup(const std::string & principal, int kvno, int enctype, bool latest, list_handler * handler);
+    bool selected(const krb5_keytab_entry & entry) const;
+
+    // source of the entries for update() and copy()
+    struct entry_source {
+        virtual bool valid() const = 0;
+        virtual krb5_error_code scan(scan_handler & handler) const = 0;
+    };
+    struct keytab_source;
+    struct snapshot_source;
+    bool update(const entry_source & source);
+    bool copy(const entry_source & source);
+
     krb5_error_code updateEntry(krb5_keytab_entry * updatedEntry);
     bool removeEntries(const std::vector<krb5_keytab_entry> & entries_to_remove);
 };
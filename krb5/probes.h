@@ -0,0 +1,24 @@
+#pragma once
+
+// User-space static tracepoints (USDT) of the provider "akt", e.g. for
+// bpftrace or perf:
+//
+//   bpftrace -e 'usdt:/usr/bin/akt:akt:list__done { @[str(arg0)] = count(); }'
+//
+// Every probe compiles to a single nop and its arguments are only read by an
+// attached tracer. Without <sys/sdt.h> (from systemtap-sdt-dev) the probes are
+// compiled out completely. See tracing/*.bt for the probes and their arguments.
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define AKT_PROBE(name)                     DTRACE_PROBE(akt, name)
+#define AKT_PROBE1(name, a1)                DTRACE_PROBE1(akt, name, a1)
+#define AKT_PROBE2(name, a1, a2)            DTRACE_PROBE2(akt, name, a1, a2)
+#define AKT_PROBE3(name, a1, a2, a3)        DTRACE_PROBE3(akt, name, a1, a2, a3)
+#define AKT_PROBE4(name, a1, a2, a3, a4)    DTRACE_PROBE4(akt, name, a1, a2, a3, a4)
+#else
+#define AKT_PROBE(name)                     do {} while(0)
+#define AKT_PROBE1(name, a1)                do {} while(0)
+#define AKT_PROBE2(name, a1, a2)            do {} while(0)
+#define AKT_PROBE3(name, a1, a2, a3)        do {} while(0)
+#define AKT_PROBE4(name, a1, a2, a3, a4)    do {} while(0)
+#endif
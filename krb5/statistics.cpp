@@ -0,0 +1,102 @@
+#include "statistics.h"
+#include <mutex>
+#include <string.h>
+#include <time.h>
+
+namespace arsoft {
+    namespace krb5 {
+
+namespace {
+
+// counters of all threads which have already exited
+std::mutex finished_mutex;
+statistics::values finished;
+
+} // namespace
+
+thread_local statistics::thread_values statistics::_local;
+bool statistics::_timers_enabled = false;
+
+statistics::thread_values::thread_values()
+    : current(NULL)
+{
+    memset(counters, 0, sizeof(counters));
+    memset(phases, 0, sizeof(phases));
+}
+
+statistics::thread_values::~thread_values()
+{
+    std::lock_guard<std::mutex> lock(finished_mutex);
+    for(int i = 0; i < counter_count; ++i)
+        finished.counters[i] += counters[i];
+    for(int i = 0; i < phase_count; ++i)
+        finished.phases[i] += phases[i];
+}
+
+void statistics::get(values & v)
+{
+    std::lock_guard<std::mutex> lock(finished_mutex);
+    for(int i = 0; i < counter_count; ++i)
+        v.counters[i] = finished.counters[i] + _local.counters[i];
+    for(int i = 0; i < phase_count; ++i)
+        v.phases[i] = finished.phases[i] + _local.phases[i];
+}
+
+uint64_t statistics::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+const char * statistics::name(counter c)
+{
+    switch(c)
+    {
+    case entries_scanned: return "entries_scanned";
+    case krb5_calls: return "krb5_calls";
+    case bytes_read: return "bytes_read";
+    case bytes_written: return "bytes_written";
+    case allocations: return "allocations";
+    case cursor_restarts: return "cursor_restarts";
+    default: return "unknown";
+    }
+}
+
+const char * statistics::name(phase p)
+{
+    switch(p)
+    {
+    case phase_init: return "init";
+    case phase_read: return "read";
+    case phase_unparse: return "unparse";
+    case phase_sort: return "sort";
+    case phase_output: return "output";
+    case phase_write: return "write";
+    default: return "unknown";
+    }
+}
+
+void statistics::timer::start()
+{
+    thread_values & local = _local;
+    _start = now();
+    // the enclosing phase is paused until this timer stops
+    _parent = local.current;
+    if(_parent)
+        local.phases[_parent->_phase] += _start - _parent->_start;
+    local.current = this;
+}
+
+void statistics::timer::stop()
+{
+    thread_values & local = _local;
+    const uint64_t end = now();
+    local.phases[_phase] += end - _start;
+    local.current = _parent;
+    if(_parent)
+        _parent->_start = end;
+}
+
+    } // namespace krb5
+} // namespace arsoft
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace arsoft {
+    namespace krb5 {
+
+// Process-wide performance counters and per-phase timers, e.g. to find out
+// whether a slow run is spent in libkrb5, file I/O or the output.
+//
+// The counters are always on: every thread counts into its own (thread local)
+// counters without any synchronization, and they are added to the global
+// counters when the thread exits. The timers only read the monotonic clock
+// once enabled. Timers nest: the time spent within an inner timer is only
+// attributed to the inner phase, so the phases never overlap. Times of
+// parallel threads add up and may exceed the elapsed time.
+class statistics
+{
+public:
+    enum counter {
+        entries_scanned,        // entries read from keytabs
+        krb5_calls,             // calls into libkrb5 for principals and keytabs
+        bytes_read,             // keytab (and index) files
+        bytes_written,
+        allocations,            // memory blocks allocated by arenas
+        cursor_restarts,        // scans of a keytab from its first entry
+        counter_count
+    };
+    enum phase {
+        phase_init,             // krb5_init_context()
+        phase_read,             // reading and parsing keytabs
+        phase_unparse,          // principal names
+        phase_sort,
+        phase_output,
+        phase_write,            // keytabs and indexes
+        phase_count
+    };
+
+    struct values {
+        uint64_t counters[counter_count];
+        uint64_t phases[phase_count];     // nanoseconds
+    };
+
+    static void count(counter c, uint64_t n=1) { _local.counters[c] += n; }
+    static void enable_timers(bool enable) { _timers_enabled = enable; }
+    static bool timers_enabled() { return _timers_enabled; }
+    // returns the counters of all finished threads and the calling thread
+    static void get(values & v);
+    static uint64_t now();
+
+    static const char * name(counter c);
+    static const char * name(phase p);
+
+    class timer
+    {
+    public:
+        explicit timer(phase p) : _phase(p), _parent(NULL), _start(0), _active(_timers_enabled)
+        {
+            if(_active)
+                start();
+        }
+        ~timer()
+        {
+            if(_active)
+                stop();
+        }
+
+    private:
+        phase _phase;
+        timer * _parent;
+        uint64_t _start;
+        bool _active;
+
+        timer(const timer & rhs);
+        timer & operator=(const timer & rhs);
+
+        void start();
+        void stop();
+    };
+
+private:
+    struct thread_values : public values {
+        timer * current;
+        thread_values();
+        ~thread_values();
+    };
+    static thread_local thread_values _local;
+    // only changed before any timers are used
+    static bool _timers_enabled;
+};
+
+    } // namespace krb5
+} // namespace arsoft